@@ -13,6 +13,8 @@
 #include <was/common.h>
 #include <was/table.h>
 
+#include "RequestExecutor.h"
+#include "Router.h"
 #include "TableCache.h"
 #include "make_unique.h"
 
@@ -46,7 +48,6 @@ using web::http::http_request;
 using web::http::methods;
 using web::http::status_code;
 using web::http::status_codes;
-using web::http::uri;
 
 using web::json::value;
 
@@ -64,15 +65,17 @@ const string auth_table_partition_prop {"DataPartition"};
 const string auth_table_row_prop {"DataRow"};
 const string data_table_name {"DataTable"};
 
-const string get_read_token_op {"GetReadToken"};
-const string get_update_token_op {"GetUpdateToken"};
-const string get_update_data {"GetUpdateData"};
-
 /*
   Cache of opened tables
 */
 TableCache table_cache {};
 
+/*
+  Queue between the listener and the handlers; each handler waits
+  for Azure Storage, so it has a worker per concurrent request
+*/
+RequestExecutor executor {32, 1000, 32};
+
 /*
   Convert properties represented in Azure Storage type
   to prop_str_vals_t type.
@@ -177,20 +180,21 @@ pair<status_code,string> do_get_token (const cloud_table& data_table,
   Top-level routine for processing all HTTP GET requests.
 */
 void handle_get(http_request message) { 
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** AuthServer GET " << path << endl;
-  auto paths = uri::split_path(path);
+  const RequestPath path {message.request_uri().path()};
+  cout << endl << "**** AuthServer GET " << path.text() << endl;
+  const command op {path.operation()};
   // Need at least an operation and userid
-  if (paths.size() < 2) {
+  if (path.size() < 2) {
     message.reply(status_codes::BadRequest);
     return;
   }
+  const string user_id {path[1]};
 	cloud_table table {table_cache.lookup_table("AuthTable")};
 	cloud_table data_table {table_cache.lookup_table("DataTable")};
 	
 	unordered_map<string,string> json_body {get_json_body (message)};
-	// paths[0] = GetUpdateData | paths[1] = <UserID>
-	if( paths[0] == get_read_token_op ){
+	// path[0] = GetUpdateData | path[1] = <UserID>
+	if( op == command::get_read_token ){
 		table_query query {};
 		table_query_iterator end;
 		table_query_iterator it = table.execute_query(query);
@@ -203,7 +207,7 @@ void handle_get(http_request message) {
 			return;
 		}
 		while(it != end){ // This while loop iterates through the table until it finds the requested partition
-			if( it->partition_key() == auth_table_userid_partition && it->row_key() == paths[1] ){ // Find Partition: Userid && Row: <The Userid passed in>
+			if( it->partition_key() == auth_table_userid_partition && it->row_key() == user_id ){ // Find Partition: Userid && Row: <The Userid passed in>
 				const table_entity::properties_type& properties = it->properties();
 				for (auto prop_it = properties.begin(); prop_it != properties.end(); ++prop_it) // Cycles through the properties of the current entity
 				{
@@ -263,8 +267,8 @@ void handle_get(http_request message) {
 		message.reply( status_codes::NotFound ); // Userid was not found
 		return;
 	}
-	// paths[0] = GetUpdateToken | paths[1] = <UserID>
-	if( paths[0] == get_update_token_op ){
+	// path[0] = GetUpdateToken | path[1] = <UserID>
+	if( op == command::get_update_token ){
 		table_query query {};
 		table_query_iterator end;
 		table_query_iterator it = table.execute_query(query);
@@ -277,7 +281,7 @@ void handle_get(http_request message) {
 			return;
 		}
 		while(it != end){ // This while loop iterates through the table until it finds the requested partition
-			if( it->partition_key() == auth_table_userid_partition && it->row_key() == paths[1] ){ // Find Partition: Userid && Row: <The Userid passed in>
+			if( it->partition_key() == auth_table_userid_partition && it->row_key() == user_id ){ // Find Partition: Userid && Row: <The Userid passed in>
 				const table_entity::properties_type& properties = it->properties();
 				for (auto prop_it = properties.begin(); prop_it != properties.end(); ++prop_it) // Cycles through the properties of the current entity
 				{
@@ -335,8 +339,8 @@ void handle_get(http_request message) {
 			++it;
 		}
 	}
-	// paths[0] = GetUpdateData | paths[1] = <UserID>
-	if( paths[0] == get_update_data ){
+	// path[0] = GetUpdateData | path[1] = <UserID>
+	if( op == command::get_update_data ){
 		table_query query {};
 		table_query_iterator end;
 		table_query_iterator it = table.execute_query(query);
@@ -349,7 +353,7 @@ void handle_get(http_request message) {
 			return;
 		}
 		while(it != end){ // This while loop iterates through the table until it finds the requested partition
-			if( it->partition_key() == auth_table_userid_partition && it->row_key() == paths[1] ){ // Find Partition: Userid && Row: <The Userid passed in>
+			if( it->partition_key() == auth_table_userid_partition && it->row_key() == user_id ){ // Find Partition: Userid && Row: <The Userid passed in>
 				const table_entity::properties_type& properties = it->properties();
 				for (auto prop_it = properties.begin(); prop_it != properties.end(); ++prop_it) // Cycles through the properties of the current entity
 				{
@@ -417,24 +421,21 @@ void handle_get(http_request message) {
   Top-level routine for processing all HTTP POST requests.
  */
 void handle_post(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** POST " << path << endl;
+  cout << endl << "**** POST " << message.request_uri().path() << endl;
 }
 
 /*
   Top-level routine for processing all HTTP PUT requests.
  */
 void handle_put(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** PUT " << path << endl;
+  cout << endl << "**** PUT " << message.request_uri().path() << endl;
 }
 
 /*
   Top-level routine for processing all HTTP DELETE requests.
  */
 void handle_delete(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** DELETE " << path << endl;
+  cout << endl << "**** DELETE " << message.request_uri().path() << endl;
 }
 
 /*
@@ -458,19 +459,29 @@ int main (int argc, char const * argv[]) {
   cout << "AuthServer: Parsing connection string" << endl;
   table_cache.init (storage_connection_string);
 
+  // Open both tables and the connection to Azure Storage before the first request
+  cout << "AuthServer: Warming up" << endl;
+  for (const auto& name : {auth_table_name, data_table_name}) {
+    if ( ! table_cache.table_exists(name))
+      cout << "AuthServer: no table " << name << endl;
+  }
+
   cout << "AuthServer: Opening listener" << endl;
   http_listener listener {def_url};
-  listener.support(methods::GET, &handle_get);
+  listener.support(methods::GET, executor.admit(&handle_get));
   //listener.support(methods::POST, &handle_post);
   //listener.support(methods::PUT, &handle_put);
   //listener.support(methods::DEL, &handle_delete);
   listener.open().wait(); // Wait for listener to complete starting
+  cout << "AuthServer: Ready" << endl;
 
   cout << "Enter carriage return to stop AuthServer." << endl;
   string line;
   getline(std::cin, line);
 
   // Shut it down
+  executor.stop();
   listener.close().wait();
+  cout << "AuthServer requests: " << executor.get_metrics() << endl;
   cout << "AuthServer closed" << endl;
 }
@@ -2,7 +2,13 @@
  Basic Server code for CMPT 276, Spring 2016.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <deque>
 #include <exception>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -20,6 +26,17 @@
 #include <was/storage_account.h>
 #include <was/table.h>
 
+#include "BulkWriter.h"
+#include "Compression.h"
+#include "EntityCache.h"
+#include "EntityJson.h"
+#include "JobJournal.h"
+#include "JobManager.h"
+#include "JsonArrayStream.h"
+#include "KeyFilter.h"
+#include "PropertyIndex.h"
+#include "RequestExecutor.h"
+#include "Router.h"
 #include "TableCache.h"
 #include "make_unique.h"
 
@@ -31,12 +48,16 @@ using azure::storage::storage_credentials;
 using azure::storage::storage_exception;
 using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
-using azure::storage::edm_type;
+using azure::storage::continuation_token;
 using azure::storage::entity_property;
+using azure::storage::query_comparison_operator;
+using azure::storage::query_logical_operator;
+using azure::storage::table_batch_operation;
 using azure::storage::table_entity;
 using azure::storage::table_operation;
 using azure::storage::table_query;
 using azure::storage::table_query_iterator;
+using azure::storage::table_query_segment;
 using azure::storage::table_result;
 
 using pplx::extensibility::critical_section_t;
@@ -52,8 +73,11 @@ using std::string;
 using std::unordered_map;
 using std::vector;
 
+using web::http::header_names;
+using web::http::http_exception;
 using web::http::http_headers;
 using web::http::http_request;
+using web::http::http_response;
 using web::http::methods;
 using web::http::status_code;
 using web::http::status_codes;
@@ -67,18 +91,64 @@ using prop_vals_t = vector<pair<string,value>>;
 
 constexpr const char* def_url = "http://localhost:34568";
 
+// Larger partitions are streamed to the client without being cached
+constexpr std::size_t partition_cache_limit {1000};
+
+// Batches a table-wide property write may have outstanding at once
+std::size_t bulk_write_concurrency {16};
+
+/*
+  A property query matching more entities than this is answered by a
+  scan, which reads up to 1000 entities per request, instead of one
+  point read per match from the property index
+*/
+constexpr std::size_t max_indexed_matches {1000};
+
+// Point reads reply_indexed() has outstanding at once
+constexpr std::size_t indexed_read_window {32};
+
+/*
+  Paging of ReadEntityAdmin scans:
+    ?pagesize=<n>&continuation=<token>
+  The token for the next page, if any, is returned in a response header.
+*/
+const string page_size_param {"pagesize"};
+const string continuation_param {"continuation"};
+const string continuation_header {"X-Continuation-Token"};
+
+/*
+  Projection of ReadEntityAdmin responses to a subset of properties:
+    ?select=<name>,<name>,...
+*/
+const string select_param {"select"};
+constexpr int max_page_size {1000}; // The most Azure Table Storage returns per request
+constexpr int page_retry_seconds {1}; // Retry-After for a page that storage was too busy to read
+
+/*
+  Restriction of a ReadEntityAdmin partition query to the rows whose
+  key starts with a prefix:
+    GET ReadEntityAdmin/<table>/<partition>/<star>?prefix=<row prefix>
+  where <star> is "*". A row key that merely ends in '*' names a
+  single entity.
+*/
+const string prefix_param {"prefix"};
+
+/*
+  Upsert of many entities in one request:
+    PUT BulkUpdateEntityAdmin/<table>
+  with a JSON array body of
+    {"Partition": <partition>, "Row": <row>, "Properties": {<name>: <value>, ...}}
+*/
+constexpr std::size_t max_bulk_entities {10000};
+
 /*
-	URI Commands stored inside variables
+  Read of many entities by key in one request:
+    GET ReadEntitiesAdmin/<table>
+  with a JSON array body of
+    {"Partition": <partition>, "Row": <row>}
+  The ?select parameter applies as for ReadEntityAdmin.
 */
-const string create_table {"CreateTableAdmin"};
-const string delete_table {"DeleteTableAdmin"};
-const string update_entity_admin {"UpdateEntityAdmin"};
-const string delete_entity {"DeleteEntityAdmin"};
-const string read_entity_admin {"ReadEntityAdmin"};
-const string read_entity_auth {"ReadEntityAuth"};
-const string update_entity_auth {"UpdateEntityAuth"};
-const string add_property_admin {"AddPropertyAdmin"};
-const string update_property_admin {"UpdatePropertyAdmin"};
+constexpr std::size_t max_read_keys {1000};
 
 /*
   Cache of opened tables
@@ -86,34 +156,693 @@ const string update_property_admin {"UpdatePropertyAdmin"};
 TableCache table_cache {};
 
 /*
-  Convert properties represented in Azure Storage type
-  to prop_vals_t type.
+  Cache of entities read by point GETs
 */
-prop_vals_t get_properties (const table_entity::properties_type& properties, prop_vals_t values = prop_vals_t {}) {
-  for (const auto v : properties) {
-    if (v.second.property_type() == edm_type::string) {
-      values.push_back(make_pair(v.first, value::string(v.second.string_value())));
-    }
-    else if (v.second.property_type() == edm_type::datetime) {
-      values.push_back(make_pair(v.first, value::string(v.second.str())));
-    }
-    else if(v.second.property_type() == edm_type::int32) {
-      values.push_back(make_pair(v.first, value::number(v.second.int32_value())));      
-    }
-    else if(v.second.property_type() == edm_type::int64) {
-      values.push_back(make_pair(v.first, value::number(v.second.int64_value())));      
-    }
-    else if(v.second.property_type() == edm_type::double_floating_point) {
-      values.push_back(make_pair(v.first, value::number(v.second.double_value())));      
-    }
-    else if(v.second.property_type() == edm_type::boolean) {
-      values.push_back(make_pair(v.first, value::boolean(v.second.boolean_value())));      
+EntityCache entity_cache {};
+
+/*
+  Filters of the keys known to exist in each table
+*/
+KeyFilter key_filter {};
+
+/*
+  Index of the entities having each property name
+*/
+PropertyIndex property_index {};
+
+/*
+  Checkpoints of the background jobs, for resuming them after a restart
+*/
+JobJournal job_journal {"basicserver.journal"};
+
+/*
+  Background jobs for table-wide writes. Declared after the state
+  they use, so it is destroyed, stopping its workers, before it.
+*/
+JobManager jobs {};
+
+/*
+  Queue between the listener and the handlers, with at most 16 scans
+  and table-wide writes handled at once (see request_lane()). Declared
+  after everything the handlers use, so it is destroyed first.
+*/
+RequestExecutor executor {8, 1000, 256, 16};
+
+/*
+  Evict cached state made stale by a write. No other server caches
+  entities, so only a table's creation or deletion is published.
+*/
+void entity_written (const string& table, const string& partition, const string& row) {
+  entity_cache.invalidate(table, partition, row);
+}
+
+void table_entities_written (const string& table) {
+  entity_cache.invalidate_table(table);
+}
+
+/*
+  Return true if a storage call failed because its table does not exist.
+
+  The table's cached existence state is out of date when this happens,
+  e.g. because the table was deleted by another client.
+*/
+bool table_not_found (const storage_exception& e) {
+  return e.result().http_status_code() == status_codes::NotFound &&
+    e.result().extended_error().code() == "TableNotFound";
+}
+
+/*
+  Observe the outcome of a task whose result is no longer wanted,
+  so that its failure is not reported as unhandled.
+*/
+template <typename T>
+void discard (pplx::task<T> abandoned) {
+  abandoned.then([] (pplx::task<T> done)
+    {
+      try {
+        done.get();
+      }
+      catch (const std::exception&) {
+      }
+    });
+}
+
+/*
+  Reply to message unless a reply has already been sent
+*/
+void reply_once (const http_request& message, status_code code) {
+  try {
+    message.reply(code);
+  }
+  catch (const http_exception&) {
+    // The handler replied before it failed
+  }
+}
+
+/*
+  End the chain of continuations that handles message.
+
+  No handler waits for storage: each starts its storage calls and
+  returns, and the rest of its work runs in continuations on the
+  thread pool. If any continuation throws, the error is answered here,
+  with 404 if storage reported the table or entity missing, 412 if
+  the ETag of a conditional write no longer matched, and 500 otherwise.
+*/
+void finish (const http_request& message, const string& table_name, pplx::task<void> handled) {
+  handled.then([message, table_name] (pplx::task<void> done)
+    {
+      try {
+        done.get();
+      }
+      catch (const storage_exception& e) {
+        cout << "Azure Table Storage error: " << e.what() << endl;
+        if (table_not_found(e))
+          table_cache.set_exists(table_name, false);
+        const int code {e.result().http_status_code()};
+        reply_once(message, code == status_codes::NotFound || code == status_codes::PreconditionFailed ? code
+                                                                                                       : status_codes::InternalError);
+      }
+      catch (const std::exception& e) {
+        cout << "Request failed: " << e.what() << endl;
+        reply_once(message, status_codes::InternalError);
+      }
+    });
+}
+
+/*
+  State of a scan run by for_each_segment()
+*/
+struct segment_scan {
+  cloud_table table;
+  table_query query;
+  std::function<bool(const table_query_segment&)> each;
+  std::function<pplx::task<bool>()> ready; // May be empty
+};
+
+pplx::task<void> scan_segments (std::shared_ptr<segment_scan> scan, pplx::task<table_query_segment> pending) {
+  return pending.then([scan] (table_query_segment segment) -> pplx::task<void>
+    {
+      const continuation_token next {segment.continuation_token()};
+      if (next.empty()) {
+        scan->each(segment);
+        return pplx::task_from_result();
+      }
+
+      pplx::task<table_query_segment> prefetch {scan->table.execute_query_segmented_async(scan->query, next)};
+      bool more {false};
+      try {
+        more = scan->each(segment);
+      }
+      catch (...) {
+        discard(prefetch);
+        throw;
+      }
+      if ( ! more) {
+        discard(prefetch);
+        return pplx::task_from_result();
+      }
+      if ( ! scan->ready)
+        return scan_segments(scan, prefetch);
+      return scan->ready().then([scan, prefetch] (bool go) -> pplx::task<void>
+        {
+          if ( ! go) {
+            discard(prefetch);
+            return pplx::task_from_result();
+          }
+          return scan_segments(scan, prefetch);
+        });
+    });
+}
+
+/*
+  Read the results of query a segment at a time without blocking,
+  calling each on every segment in turn until it returns false or
+  the results end. The next segment is requested before each is
+  called on the current one.
+
+  If ready is given, it is called after each call that returns true,
+  and the next segment is only passed to each once the task it
+  returns yields true. The scan ends if it yields false.
+
+  The task completes after the last call, or fails with the first
+  storage error.
+*/
+pplx::task<void> for_each_segment (const cloud_table& table, const table_query& query,
+                                   std::function<bool(const table_query_segment&)> each,
+                                   std::function<pplx::task<bool>()> ready = nullptr) {
+  std::shared_ptr<segment_scan> scan {std::make_shared<segment_scan>(segment_scan {table, query, each, ready})};
+  return scan_segments(scan, table.execute_query_segmented_async(query, continuation_token {}));
+}
+
+/*
+  Start a background scan of every key in a table to rebuild
+  its key filter, unless a rebuild is already running.
+*/
+void rebuild_key_filter (const string& table_name) {
+  if ( ! key_filter.begin_rebuild(table_name))
+    return;
+  cloud_table table {table_cache.lookup_table(table_name)};
+  table_query query {};
+  query.set_select_columns(vector<string> {"PartitionKey", "RowKey"});
+  for_each_segment(table, query, [table_name] (const table_query_segment& segment)
+    {
+      for (const auto& e : segment.results())
+        key_filter.add_scanned(table_name, e.partition_key(), e.row_key());
+      return true;
+    })
+    .then([table_name] (pplx::task<void> scan)
+      {
+        try {
+          scan.get();
+          key_filter.finish_rebuild(table_name);
+        }
+        catch (const std::exception& e) {
+          cout << "Key filter rebuild of " << table_name << " failed: " << e.what() << endl;
+          key_filter.abort_rebuild(table_name);
+        }
+        catch (...) { // A rebuild left running would never let another start
+          cout << "Key filter rebuild of " << table_name << " failed" << endl;
+          key_filter.abort_rebuild(table_name);
+        }
+      });
+}
+
+/*
+  Start a background scan of every entity in a table to rebuild
+  its property index, unless a rebuild is already running or the
+  last began too recently. The scan stops early if the table turns
+  out to be too large to index.
+*/
+void rebuild_property_index (const string& table_name) {
+  if ( ! property_index.begin_rebuild(table_name))
+    return;
+  cloud_table table {table_cache.lookup_table(table_name)};
+  for_each_segment(table, table_query {}, [table_name] (const table_query_segment& segment)
+    {
+      vector<string> names;
+      for (const auto& e : segment.results()) {
+        names.clear();
+        for (const auto& p : e.properties())
+          names.push_back(p.first);
+        if ( ! property_index.add_scanned(table_name, e.partition_key(), e.row_key(), names))
+          return false;
+      }
+      return true;
+    })
+    .then([table_name] (pplx::task<void> scan)
+      {
+        try {
+          scan.get();
+          property_index.finish_rebuild(table_name);
+        }
+        catch (const std::exception& e) {
+          cout << "Property index rebuild of " << table_name << " failed: " << e.what() << endl;
+          property_index.abort_rebuild(table_name);
+        }
+        catch (...) { // While building is set, no later rebuild of the table starts
+          cout << "Property index rebuild of " << table_name << " failed" << endl;
+          property_index.abort_rebuild(table_name);
+        }
+      });
+}
+
+/*
+  A query for every entity of a partition, or only those whose
+  row key starts with row_prefix if it is not empty.
+
+  The partition and row range are sent to Azure Storage as a
+  filter, so only the matching entities are transferred.
+*/
+table_query partition_query (const string& partition, const string& row_prefix = string {}) {
+  string filter {table_query::generate_filter_condition("PartitionKey", query_comparison_operator::equal, partition)};
+  if ( ! row_prefix.empty()) {
+    // Every row key with the prefix sorts before the prefix followed by U+FFFF
+    string rows {table_query::combine_filter_conditions(
+        table_query::generate_filter_condition("RowKey", query_comparison_operator::greater_than_or_equal, row_prefix),
+        query_logical_operator::op_and,
+        table_query::generate_filter_condition("RowKey", query_comparison_operator::less_than, row_prefix + "\xef\xbf\xbf"))};
+    filter = table_query::combine_filter_conditions(filter, query_logical_operator::op_and, rows);
+  }
+  table_query query {};
+  query.set_filter_string(filter);
+  return query;
+}
+
+/*
+  Return every entity of a partition
+*/
+vector<table_entity> read_partition (const cloud_table& table, const string& partition) {
+  vector<table_entity> entities;
+  table_query_iterator end;
+  for (table_query_iterator it {table.execute_query(partition_query(partition))}; it != end; ++it) {
+    entities.push_back(*it);
+  }
+  return entities;
+}
+
+/*
+  Return the property names listed in the query string of message,
+  as ?select=<name>,<name>,... An empty result means every property.
+*/
+vector<string> requested_columns (const http_request& message) {
+  vector<string> columns;
+  auto params (uri::split_query(message.request_uri().query()));
+  auto select (params.find(select_param));
+  if (select == params.end())
+    return columns;
+  string names {uri::decode(select->second)};
+  std::size_t start {0};
+  while (start <= names.size()) {
+    std::size_t comma {names.find(',', start)};
+    if (comma == string::npos)
+      comma = names.size();
+    if (comma > start)
+      columns.push_back(names.substr(start, comma - start));
+    start = comma + 1;
+  }
+  return columns;
+}
+
+/*
+  Return the row prefix in the query string of message,
+  or an empty string for every row of the partition
+*/
+string requested_row_prefix (const http_request& message) {
+  auto params (uri::split_query(message.request_uri().query()));
+  auto prefix (params.find(prefix_param));
+  if (prefix == params.end())
+    return string {};
+  return uri::decode(prefix->second);
+}
+
+/*
+  Ask storage to return only the keys and the named properties,
+  unless columns is empty.
+*/
+void select_columns (table_query& query, const vector<string>& columns) {
+  if (columns.empty())
+    return;
+  vector<string> selected {"PartitionKey", "RowKey"};
+  selected.insert(selected.end(), columns.begin(), columns.end());
+  query.set_select_columns(selected);
+}
+
+/*
+  How a scan streamed by stream_query() ended
+*/
+enum class scan_outcome { complete, incomplete, not_found };
+
+/*
+  State of a scan streamed by stream_query()
+*/
+struct streamed_scan {
+  http_request message;
+  std::function<bool(const table_entity&)> keep;
+  vector<string> columns;
+  bool not_found_if_empty;
+  std::unique_ptr<JsonArrayStream> body; // Created when the status is sent
+  scan_outcome outcome;
+  string element; // Reused for each entity
+};
+
+/*
+  Stream the results of query as a JSON array of objects holding
+  Partition, Row and the entity's properties, or only those named
+  in columns if it is not empty.
+
+  keep is called on each entity read and returns whether to include
+  it in the response. The response is begun when the first segment of
+  results arrives; a compressed one sends its status and headers once
+  enough of the body is ready (see JsonArrayStream). If
+  not_found_if_empty is true and the query has no results at all, 404
+  is sent instead.
+
+  The task yields incomplete if the client stopped reading or storage
+  failed after the response was begun. A storage error before then
+  fails the task, to be answered by finish().
+
+  No thread waits for storage or for a slow client: each segment is
+  streamed only once the client has read most of the ones before it
+  (see JsonArrayStream::drained()).
+*/
+pplx::task<scan_outcome> stream_query (const http_request& message, const cloud_table& table, const table_query& query,
+                                       std::function<bool(const table_entity&)> keep, const vector<string>& columns,
+                                       bool not_found_if_empty = false) {
+  std::shared_ptr<streamed_scan> scan {std::make_shared<streamed_scan>(
+      streamed_scan {message, keep, columns, not_found_if_empty, nullptr, scan_outcome::complete, string {}})};
+  return for_each_segment(table, query, [scan] (const table_query_segment& segment) -> bool
+    {
+      if ( ! scan->body) {
+        if (scan->not_found_if_empty && segment.results().empty()) {
+          if (segment.continuation_token().empty()) { // The query has no results
+            scan->outcome = scan_outcome::not_found;
+            scan->message.reply(status_codes::NotFound);
+          }
+          return true;
+        }
+        scan->body = std::make_unique<JsonArrayStream>();
+        scan->body->reply(scan->message);
+      }
+      for (const auto& e : segment.results()) {
+        if ( ! scan->keep(e))
+          continue;
+        cout << "Key: " << e.partition_key() << " / " << e.row_key() << endl;
+        scan->element.clear();
+        append_entity_json(scan->element, e, true, scan->columns);
+        if ( ! scan->body->add_json(scan->element)) {
+          scan->outcome = scan_outcome::incomplete;
+          return false;
+        }
+      }
+      return true;
+    },
+    [scan] () -> pplx::task<bool>
+    {
+      if ( ! scan->body)
+        return pplx::task_from_result(true);
+      return scan->body->drained().then([scan] (bool room)
+        {
+          if ( ! room)
+            scan->outcome = scan_outcome::incomplete;
+          return room;
+        });
+    })
+    .then([scan] (pplx::task<void> done) -> scan_outcome
+      {
+        try {
+          done.get();
+        }
+        catch (const storage_exception& e) {
+          if ( ! scan->body)
+            throw;
+          // The status has already been sent; end the body with an unterminated array
+          cout << "Azure Table Storage error during scan: " << e.what() << endl;
+          scan->outcome = scan_outcome::incomplete;
+        }
+        if (scan->body)
+          scan->body->close(scan->outcome == scan_outcome::complete);
+        return scan->outcome;
+      });
+}
+
+/*
+  Stream the results of query as by stream_query(), when nothing
+  needs to be done once the scan ends.
+*/
+pplx::task<void> stream_entities (const http_request& message, const cloud_table& table, const table_query& query,
+                                  std::function<bool(const table_entity&)> keep, const vector<string>& columns) {
+  return stream_query(message, table, query, keep, columns).then([] (scan_outcome) {});
+}
+
+/*
+  Return the page size requested in the query string of message,
+  0 if no paging was requested or -1 if the size is not a positive number.
+  Sizes above max_page_size are reduced to it.
+*/
+int requested_page_size (const http_request& message) {
+  auto params (uri::split_query(message.request_uri().query()));
+  auto size (params.find(page_size_param));
+  if (size == params.end())
+    return 0;
+  try {
+    std::size_t used {0};
+    int n {std::stoi(size->second, &used)};
+    if (used != size->second.size() || n <= 0)
+      return -1;
+    return std::min(n, max_page_size);
+  }
+  catch (const std::exception&) {
+    return -1;
+  }
+}
+
+/*
+  Return the continuation token in the query string of message,
+  or an empty token to start from the first page.
+*/
+continuation_token requested_continuation (const http_request& message) {
+  auto params (uri::split_query(message.request_uri().query()));
+  auto token (params.find(continuation_param));
+  if (token == params.end())
+    return continuation_token {};
+  return continuation_token {uri::decode(token->second)};
+}
+
+/*
+  Reply with one page of query results, as a JSON array like the one
+  from stream_query. keep is called on each entity read and returns
+  whether to include it, so a page may hold fewer than page_size entities
+  and may even be empty when more pages follow.
+
+  If the scan is not finished, the continuation header holds the token
+  to pass back for the next page.
+
+  If not_found_if_empty is true, a first page that ends the scan
+  without any entities is answered with 404.
+
+  A page storage rejects as a bad request is answered with 400, one it
+  timed out or throttled with 503 and Retry-After, and any other
+  failure with 500.
+*/
+pplx::task<void> reply_page (const http_request& message, const cloud_table& table, table_query query, int page_size,
+                             std::function<bool(const table_entity&)> keep, const vector<string>& columns,
+                             bool not_found_if_empty = false) {
+  const continuation_token token {requested_continuation(message)};
+  const string table_name {table.name()};
+  query.set_take_count(page_size);
+  return table.execute_query_segmented_async(query, token)
+    .then([message, table_name, token, keep, columns, not_found_if_empty] (pplx::task<table_query_segment> read)
+      {
+        table_query_segment segment;
+        try {
+          segment = read.get();
+        }
+        catch (const storage_exception& e) {
+          if (table_not_found(e)) {
+            table_cache.set_exists(table_name, false);
+            message.reply(status_codes::NotFound);
+            return;
+          }
+          cout << "Azure Table Storage error: " << e.what() << endl;
+          const int code {e.result().http_status_code()};
+          // Most often a continuation token that was altered or is from another query
+          if (code == status_codes::BadRequest) {
+            message.reply(status_codes::BadRequest);
+            return;
+          }
+          // Storage timed out or is throttling; the same page can be asked for again
+          if (code == status_codes::ServiceUnavailable || code == status_codes::InternalError) {
+            http_response response {status_codes::ServiceUnavailable};
+            response.headers().add(header_names::retry_after, page_retry_seconds);
+            message.reply(response);
+            return;
+          }
+          message.reply(status_codes::InternalError);
+          return;
+        }
+
+        string& body (json_buffer());
+        body += '[';
+        bool any {false};
+        for (const auto& e : segment.results()) {
+          if ( ! keep(e))
+            continue;
+          if (any)
+            body += ',';
+          append_entity_json(body, e, true, columns);
+          any = true;
+        }
+        body += ']';
+        const continuation_token& next {segment.continuation_token()};
+        if (not_found_if_empty && token.empty() && next.empty() && ! any) {
+          message.reply(status_codes::NotFound);
+          return;
+        }
+
+        http_response response {status_codes::OK};
+        if ( ! next.empty())
+          response.headers().add(continuation_header, uri::encode_data_string(next.next_marker()));
+        set_json_body(message, response, body);
+        message.reply(response);
+      });
+}
+
+/*
+  State of a response streamed by reply_indexed()
+*/
+struct indexed_reply {
+  http_request message;
+  cloud_table table;
+  string table_name;
+  vector<pair<string,string>> keys;
+  std::function<bool(const table_entity&)> keep;
+  vector<string> columns;
+  std::unique_ptr<JsonArrayStream> body; // Created when the first window has been read
+  string element; // Reused for each entity
+};
+
+/*
+  Read the entities at keys[start, start + indexed_read_window), from
+  the entity cache where possible and otherwise concurrently from
+  storage, add those that are kept to the body in key order, then go
+  on to the next window. The task yields false if the client stopped
+  reading.
+*/
+pplx::task<bool> reply_window (std::shared_ptr<indexed_reply> reply, std::size_t start) {
+  const std::size_t end {std::min(start + indexed_read_window, reply->keys.size())};
+  // Each read fills in only its own elements, so the reads need no lock
+  std::shared_ptr<vector<table_entity>> entities {std::make_shared<vector<table_entity>>(end - start)};
+  std::shared_ptr<vector<char>> found {std::make_shared<vector<char>>(end - start, false)};
+  const EntityCache::read_mark mark {entity_cache.mark()};
+  vector<pplx::task<void>> reads;
+  for (std::size_t i = start; i < end; ++i) {
+    const string& partition (reply->keys[i].first);
+    const string& row (reply->keys[i].second);
+    EntityCache::lookup_result cached {entity_cache.lookup(reply->table_name, partition, row, (*entities)[i - start])};
+    if (cached == EntityCache::hit) {
+      (*found)[i - start] = true;
     }
-    else {
-      values.push_back(make_pair(v.first, value::string(v.second.str())));
+    else if (cached == EntityCache::miss) {
+      reads.push_back(reply->table.execute_async(table_operation::retrieve_entity(partition, row))
+        .then([reply, entities, found, start, i, mark] (table_result result)
+          {
+            const pair<string,string>& key (reply->keys[i]);
+            if (result.http_status_code() == status_codes::NotFound) {
+              entity_cache.insert_missing(reply->table_name, key.first, key.second, mark);
+              return;
+            }
+            (*entities)[i - start] = result.entity();
+            entity_cache.insert(reply->table_name, (*entities)[i - start], mark);
+            (*found)[i - start] = true;
+          }));
     }
   }
-  return values;
+
+  return pplx::when_all(reads.begin(), reads.end())
+    .then([reply, entities, found, end] () -> pplx::task<bool>
+      {
+        if ( ! reply->body) {
+          reply->body = std::make_unique<JsonArrayStream>();
+          reply->body->reply(reply->message);
+        }
+        for (std::size_t i = 0; i < entities->size(); ++i) {
+          if ( ! (*found)[i] || ! reply->keep((*entities)[i]))
+            continue;
+          reply->element.clear();
+          append_entity_json(reply->element, (*entities)[i], true, reply->columns);
+          if ( ! reply->body->add_json(reply->element))
+            return pplx::task_from_result(false);
+        }
+        if (end == reply->keys.size())
+          return pplx::task_from_result(true);
+        // Read the next window only once the client has caught up
+        return reply->body->drained().then([reply, end] (bool room) -> pplx::task<bool>
+          {
+            if ( ! room)
+              return pplx::task_from_result(false);
+            return reply_window(reply, end);
+          });
+      });
+}
+
+/*
+  Reply with the entities at keys, as a JSON array like the one from
+  stream_query. Entities are read from the entity cache where
+  possible and otherwise from storage, at most indexed_read_window at
+  once, and streamed to the client a window at a time, so neither the
+  reads outstanding nor the entities held grow with the number of keys.
+
+  keys may list entities that no longer qualify or exist, so only the
+  entities for which keep returns true are included.
+
+  As for stream_query, a storage error before the response is begun
+  fails the task, to be answered by finish(); one after ends the body
+  with an unterminated array.
+*/
+pplx::task<void> reply_indexed (const http_request& message, const cloud_table& table, const string& table_name,
+                                const vector<pair<string,string>>& keys,
+                                std::function<bool(const table_entity&)> keep, const vector<string>& columns) {
+  std::shared_ptr<indexed_reply> reply {std::make_shared<indexed_reply>(
+      indexed_reply {message, table, table_name, keys, keep, columns, nullptr, string {}})};
+  return reply_window(reply, 0)
+    .then([reply] (pplx::task<bool> done)
+      {
+        bool complete {false};
+        try {
+          complete = done.get();
+        }
+        catch (const storage_exception& e) {
+          if ( ! reply->body)
+            throw;
+          cout << "Azure Table Storage error during indexed read: " << e.what() << endl;
+        }
+        reply->body->close(complete);
+      });
+}
+
+/*
+  Return the property names in a JSON body
+*/
+vector<string> property_names (const unordered_map<string,string>& body) {
+  vector<string> names;
+  for (const auto& p : body)
+    names.push_back(p.first);
+  return names;
+}
+
+/*
+  Return the table, token, partition and row of a request
+  using a security token (ReadEntityAuth or UpdateEntityAuth),
+  or an empty vector if the path is malformed.
+
+  As in ServerUtils, the token is left undecoded, as it may
+  contain an encoded '/'.
+*/
+vector<string> token_request_key (const http_request& message) {
+  const RequestPath path {message.request_uri().path()};
+  if (path.size() != 5)
+    return vector<string> {};
+  return vector<string> {path[1], path.segment(2).str(), path[3], path[4]};
 }
 
 /*
@@ -127,10 +856,11 @@ bool has_json_body (http_request message) {
 }
 
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
+  Given an HTTP message with a JSON body, return a task yielding the
+  JSON body as an unordered map of strings to strings, once the body
+  has arrived.
 
-  If the message has no JSON body, return an empty map.
+  If the message has no JSON body, the task yields an empty map.
 
   THIS ROUTINE CAN ONLY BE CALLED ONCE FOR A GIVEN MESSAGE
   (see http://microsoft.github.io/cpprestsdk/classweb_1_1http_1_1http__request.html#ae6c3d7532fe943de75dcc0445456cbc7
@@ -140,34 +870,364 @@ bool has_json_body (http_request message) {
   Use C++ conversion utilities to convert to numbers or dates
   as necessary.
 */
-unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
+pplx::task<unordered_map<string,string>> get_json_body_async(http_request message) {
   const http_headers& headers {message.headers()};
   auto content_type (headers.find("Content-Type"));
   if (content_type == headers.end() ||
       content_type->second != "application/json")
-    return results;
+    return pplx::task_from_result(unordered_map<string,string> {});
+
+  return message.extract_json(true)
+    .then([] (value json)
+	  {
+	    unordered_map<string,string> results {};
+	    if (json.is_object()) {
+	      for (const auto& v : json.as_object()) {
+		if (v.second.is_string()) {
+		  results[v.first] = v.second.as_string();
+		}
+		else {
+		  results[v.first] = v.second.serialize();
+		}
+	      }
+	    }
+	    return results;
+	  });
+}
+
+/*
+  Return true if the If-None-Match header of message lists etag or
+  is "*". As RFC 7232 requires for If-None-Match, the comparison
+  is weak: a "W/" prefix on either side is ignored.
+*/
+bool etag_matches (const http_request& message, const string& etag) {
+  const http_headers& headers {message.headers()};
+  auto if_none_match (headers.find(header_names::if_none_match));
+  if (if_none_match == headers.end() || etag.empty())
+    return false;
+
+  auto opaque = [] (const string& tag) {
+    const std::size_t start {tag.find_first_not_of(" \t")};
+    if (start == string::npos)
+      return string {};
+    const std::size_t end {tag.find_last_not_of(" \t")};
+    string t {tag.substr(start, end - start + 1)};
+    return t.compare(0, 2, "W/") == 0 ? t.substr(2) : t;
+  };
+  const string wanted {opaque(etag)};
+  const string& list (if_none_match->second);
+  for (std::size_t start = 0; start <= list.size(); ) {
+    std::size_t end {list.find(',', start)};
+    if (end == string::npos)
+      end = list.size();
+    const string tag {opaque(list.substr(start, end - start))};
+    if (tag == "*" || tag == wanted)
+      return true;
+    start = end + 1;
+  }
+  return false;
+}
+
+/*
+  Reply with json, an entity's properties serialized by
+  append_entity_json() with the given number of members. If there are
+  none, the reply has no body.
+
+  The reply carries the entity's ETag, as Azure Storage assigned it.
+  If the request's If-None-Match lists that ETag, the client's copy
+  is current, so the reply is 304 with no body.
+*/
+void reply_entity_json (const http_request& message, const string& etag, const string& json, std::size_t members) {
+  if (etag_matches(message, etag)) {
+    http_response response {status_codes::NotModified};
+    response.headers().add(header_names::etag, etag);
+    message.reply(response);
+    return;
+  }
+  http_response response {status_codes::OK};
+  if ( ! etag.empty())
+    response.headers().add(header_names::etag, etag);
+  if (members > 0)
+    set_json_body(message, response, json);
+  message.reply(response);
+}
+
+/*
+  Reply with the properties of entity as a JSON object, or only
+  those named in columns if it is not empty, as by reply_entity_json()
+*/
+void reply_properties (const http_request& message, const table_entity& entity,
+                       const vector<string>& columns = vector<string> {}) {
+  string& body (json_buffer());
+  const std::size_t members {append_entity_json(body, entity, false, columns)};
+  reply_entity_json(message, entity.etag(), body, members);
+}
+
+/*
+  Reply to a ReadEntityAuth request, reading the entity with the
+  request's security token unless it is cached for that token
+*/
+pplx::task<void> read_token_entity (const http_request& message) {
+  vector<string> key {token_request_key(message)};
+  table_entity entity;
+  if ( ! key.empty() && entity_cache.lookup_with_token(key[0], key[2], key[3], key[1], entity)) {
+    reply_properties(message, entity);
+    return pplx::task_from_result();
+  }
+  const EntityCache::read_mark mark {entity_cache.mark()};
+  return read_with_token_async(message, tables_endpoint) // Using the function from ServerUtils.cpp
+    .then([message, key, mark] (pair<status_code,table_entity> token)
+      {
+        if (token.first != status_codes::OK) {
+          message.reply(status_codes::NotFound);
+          return;
+        }
+        if ( ! key.empty())
+          entity_cache.insert(key[0], token.second, mark, key[1]);
+        reply_properties(message, token.second);
+      });
+}
+
+/*
+  Reply to a GET of one entity: Partition == path[2], Row == path[3]
+  of table_name, which the caller has already decoded from path[1]
+*/
+pplx::task<void> read_entity (const http_request& message, const cloud_table& table, const string& table_name,
+                              const RequestPath& path) {
+  if (path.size() != 4) {
+    message.reply (status_codes::BadRequest);
+    return pplx::task_from_result();
+  }
+  const string partition {path[2]};
+  const string row {path[3]};
+
+  // The whole entity is read so it can be cached; any projection is applied when replying
+  const vector<string> columns {requested_columns(message)};
+  string& body (json_buffer());
+  string etag {};
+  std::size_t members {0};
+  EntityCache::lookup_result cached {entity_cache.lookup(table_name, partition, row,
+    [&columns, &body, &etag, &members] (const table_entity& entity)
+      {
+        // Serialized in place rather than copied out of the cache
+        etag = entity.etag();
+        members = append_entity_json(body, entity, false, columns);
+      })};
+  if (cached == EntityCache::not_found ||
+      (cached == EntityCache::miss && key_filter.definitely_missing(table_name, partition, row))) {
+    message.reply(status_codes::NotFound);
+    return pplx::task_from_result();
+  }
+  if (cached == EntityCache::hit) {
+    reply_entity_json(message, etag, body, members);
+    return pplx::task_from_result();
+  }
+
+  if (key_filter.needs_rebuild(table_name))
+    rebuild_key_filter(table_name);
+  table_operation retrieve_operation {table_operation::retrieve_entity(partition, row)};
+  const EntityCache::read_mark mark {entity_cache.mark()};
+  return table.execute_async(retrieve_operation)
+    .then([message, table_name, partition, row, columns, mark] (table_result retrieve_result)
+      {
+        cout << "HTTP code: " << retrieve_result.http_status_code() << endl;
+        if (retrieve_result.http_status_code() == status_codes::NotFound) {
+          entity_cache.insert_missing(table_name, partition, row, mark);
+          message.reply(status_codes::NotFound);
+          return;
+        }
+        entity_cache.insert(table_name, retrieve_result.entity(), mark);
+        reply_properties(message, retrieve_result.entity(), columns);
+      });
+}
+
+/*
+  Reply to a ReadEntitiesAdmin request with an array of the entities
+  named in its body that exist, in the body's order. Keys that the key
+  filter rules out are skipped; the others are read as by
+  reply_indexed(), from the cache where possible and otherwise from
+  storage, concurrently.
+*/
+pplx::task<void> read_keys (const http_request& message, const cloud_table& table, const string& table_name) {
+  if ( ! has_json_body(message)) {
+    message.reply(status_codes::BadRequest);
+    return pplx::task_from_result();
+  }
+  const vector<string> columns {requested_columns(message)};
+  return message.extract_json(true)
+    .then([message, table, table_name, columns] (value body) -> pplx::task<void>
+      {
+        if ( ! body.is_array()) {
+          message.reply(status_codes::BadRequest);
+          return pplx::task_from_result();
+        }
+        if (body.as_array().size() > max_read_keys) {
+          message.reply(status_codes::RequestEntityTooLarge);
+          return pplx::task_from_result();
+        }
+
+        vector<pair<string,string>> keys;
+        for (const value& item : body.as_array()) {
+          if ( ! item.is_object() || ! item.has_field("Partition") || ! item.has_field("Row") ||
+               ! item.at("Partition").is_string() || ! item.at("Row").is_string()) {
+            message.reply(status_codes::BadRequest);
+            return pplx::task_from_result();
+          }
+          const string& partition (item.at("Partition").as_string());
+          const string& row (item.at("Row").as_string());
+          if ( ! key_filter.definitely_missing(table_name, partition, row))
+            keys.push_back(make_pair(partition, row));
+        }
+        if (key_filter.needs_rebuild(table_name))
+          rebuild_key_filter(table_name);
+        return reply_indexed(message, table, table_name, keys, [] (const table_entity&) { return true; }, columns);
+      });
+}
+
+/*
+  Reply to a ReadEntityAdmin request, with stored_message its JSON body.
+  Requests that name neither properties, a whole table nor a partition
+  are for a single entity.
+*/
+pplx::task<void> read_entities (const http_request& message, const cloud_table& table, const string& table_name,
+                                const RequestPath& path, const unordered_map<string,string>& stored_message) {
+	// Scans are streamed whole unless the client asks for one page at a time
+	int page_size {requested_page_size(message)};
+	if( page_size < 0 ){
+		message.reply(status_codes::BadRequest);
+		return pplx::task_from_result();
+	}
+	// Entities read with only some columns selected must not be cached
+	const vector<string> columns {requested_columns(message)};
+
+	// Get all entities containing all specified properties
+	if( stored_message.size() > 0 ){
+		table_query query {};
+		if( ! columns.empty() ){ // The filter also needs the properties it tests
+			vector<string> fetched {columns};
+			for( const auto& p : stored_message ){
+				fetched.push_back(p.first);
+			}
+			select_columns(query, fetched);
+		}
+		auto has_properties = [stored_message] (const table_entity& e) {
+			unsigned int equal {0};
+			const table_entity::properties_type& properties = e.properties();
+			for (auto prop_it = properties.begin(); prop_it != properties.end(); ++prop_it) // Cycles through the properties of the current entity
+			{
+				unordered_map<string,string>::const_iterator got = stored_message.find(prop_it->first);
+				if( got != stored_message.end() ){ // A property from the JSON body was found in the entity
+					equal++;
+				}
+			}
+			return equal == stored_message.size(); // All properties from the JSON body were found in the entity
+		};
+		if( page_size > 0 ){
+			return reply_page(message, table, query, page_size, has_properties, columns);
+		}
+		// Without paging, the property index avoids the scan once it is built
+		vector<pair<string,string>> keys;
+		if( property_index.lookup(table_name, property_names(stored_message), max_indexed_matches, keys) ){
+			return reply_indexed(message, table, table_name, keys, has_properties, columns);
+		}
+		if( property_index.needs_rebuild(table_name) ){
+			rebuild_property_index(table_name);
+		}
+		return stream_entities(message, table, query, has_properties, columns);
+	}
 
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-	  {
-            json = v;
-	    return true;
-	  })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-				results[v.first] = v.second.as_string();
-      }
-      else {
-				results[v.first] = v.second.serialize();
-      }
-    }
-  }
-  return results;
+	// GET all entries in table
+	if (path.size() < 3){
+		table_query query {};
+		select_columns(query, columns);
+		const bool whole {columns.empty()};
+		const EntityCache::read_mark mark {entity_cache.mark()};
+		auto cache_entity = [table_name, whole, mark] (const table_entity& e) {
+			if( whole ){
+				entity_cache.insert(table_name, e, mark); // The cache's admission policy keeps a full scan from evicting hot entities
+			}
+			return true;
+		};
+		if( page_size > 0 ){
+			return reply_page(message, table, query, page_size, cache_entity, columns);
+		}
+		return stream_entities(message, table, query, cache_entity, columns);
+	}
+
+	// GET all entities from a specific partition, or those whose row starts with a prefix
+	/*
+		URI Structure:
+		path[0] = ReadEntityAdmin | path[1] = <table name> | path[2] = <partition> | path[3] = *
+		with an optional ?prefix=<row prefix>
+	*/
+	if( path.size() == 4 && path[3] == "*" ){
+			const string partition {path[2]};
+			if( key_filter.partition_definitely_missing(table_name, partition) ){
+				message.reply(status_codes::NotFound);
+				return pplx::task_from_result();
+			}
+			if( key_filter.needs_rebuild(table_name) ){
+				rebuild_key_filter(table_name);
+			}
+			const string row_prefix {requested_row_prefix(message)};
+			table_query query {partition_query(partition, row_prefix)};
+			select_columns(query, columns);
+			if( page_size > 0 ){ // Pages bypass the partition cache
+				return reply_page(message, table, query, page_size,
+				                  [] (const table_entity&) { return true; }, columns, true);
+			}
+			vector<table_entity> entities;
+			if( ! row_prefix.empty() || ! entity_cache.lookup_partition(table_name, partition, entities) ){
+				// Stream the scan; a whole partition is also cached if it is small enough
+				struct partition_copy {
+					bool cacheable;
+					vector<table_entity> entities;
+				};
+				std::shared_ptr<partition_copy> copy {std::make_shared<partition_copy>(
+					partition_copy {row_prefix.empty() && columns.empty(), vector<table_entity> {}})};
+				const bool whole_partition {row_prefix.empty()};
+				const EntityCache::read_mark mark {entity_cache.mark()};
+				return stream_query(message, table, query, [copy] (const table_entity& e) {
+					if( copy->cacheable ){
+						copy->entities.push_back(e);
+						if( copy->entities.size() > partition_cache_limit ){
+							copy->cacheable = false;
+							copy->entities = vector<table_entity> {};
+						}
+					}
+					return true;
+				}, columns, true).then([table_name, partition, copy, whole_partition, mark] (scan_outcome outcome) {
+					if( outcome == scan_outcome::not_found ){ // The requested partition (or row range) is not a part of the table
+						if( whole_partition ){
+							entity_cache.insert_partition(table_name, partition, vector<table_entity> {}, mark);
+						}
+					}
+					else if( outcome == scan_outcome::complete && copy->cacheable ){
+						entity_cache.insert_partition(table_name, partition, copy->entities, mark);
+					}
+				});
+			}
+			
+			if( entities.empty() ){ // The cached partition is empty
+				message.reply(status_codes::NotFound);
+				return pplx::task_from_result();
+			}
+			
+			string& body (json_buffer());
+			body += '[';
+			for( const auto& e : entities ){
+				cout << "GET: " << e.partition_key() << " / " << e.row_key() << endl; 
+				if( body.size() > 1 ){
+					body += ',';
+				}
+				append_entity_json(body, e, true, columns);
+			}
+			body += ']';
+			reply_json(message, status_codes::OK, body);
+			return pplx::task_from_result();
+	}
+
+	return read_entity(message, table, table_name, path);
 }
 
 /*
@@ -175,406 +1235,833 @@ unordered_map<string,string> get_json_body(http_request message) {
 
   GET is the only request that has no command. All
   operands specify the value(s) to be retrieved.
+
+  Only the checks that need no storage call are made here; the
+  request is then answered by a chain of continuations, so the
+  listener's thread never waits for Azure Storage.
 */
 void handle_get(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** GET " << path << endl;
-  auto paths = uri::split_path(path);
+  const RequestPath path {message.request_uri().path()};
+  cout << endl << "**** GET " << path.text() << endl;
+  const command op {path.operation()};
   // Need at least a table name
-  if (paths.size() < 2 || paths.size() == 3) { // If paths.size() == 3, then only a table and either a partition or row was passed; we need both the partition and row for a complete key.
+  if (path.size() < 2 || path.size() == 3) { // If path.size() == 3, then only a table and either a partition or row was passed; we need both the partition and row for a complete key.
     message.reply(status_codes::BadRequest);
     return;
   }
 	
-	// ReadEntityAuth requires 0) ReadEntityAuth Command 1) Table Name, 2) Token, 3) Partition and 4) Row
-  if(paths[0] == read_entity_auth){
-  	if(paths.size() < 5){
-  		message.reply( status_codes::BadRequest);
-  		return;
-  	}
-  }
-	
-	// Check that the table passed in exists in Storage Layer
-  cloud_table table {table_cache.lookup_table(paths[1])};
-  if ( ! table.exists()) {
-    message.reply(status_codes::NotFound);
-    return;
-  }
+	// Progress of a background job
 	/*
 		URI Structure:
-		paths[0] = ReadEntityAuth | paths[1] = <table name> | paths[2] = <token> | paths[3] = <partition> | paths[4] = <row>
+		path[0] = GetJobAdmin | path[1] = <job id>
 	*/
-	if( paths[0] == read_entity_auth ){
-		if(paths.size() < 5){ // Less than four parameters were provided
-			message.reply(status_codes::BadRequest);
-			return;
-		}
-		pair<status_code,table_entity> token { read_with_token(message, tables_endpoint) }; // Using the function from ServerUtils.cpp
-		if(token.first != status_codes::OK){
+	if( op == command::get_job_admin ){
+		JobManager::status job;
+		if( ! jobs.get_status(path[1], job) ){
 			message.reply(status_codes::NotFound);
 			return;
 		}
-		
-		table_entity entity {token.second};
-		table_entity::properties_type properties {entity.properties()};
-		
-		// If the entity has any properties, return them as JSON
-		prop_vals_t values (get_properties(properties));
-		if (values.size() > 0){
-			message.reply(status_codes::OK, value::object(values));
-		}
-		else{
-			message.reply(status_codes::OK);
-			return;
-		}
-	}
-	// Get all entities containing all specified properties
-	if(paths[0] == read_entity_admin){
-		unordered_map<string,string> stored_message = get_json_body(message);
-		if( stored_message.size() > 0 ){
-			table_query query {};
-			table_query_iterator end;
-			table_query_iterator it = table.execute_query(query);
-			table_entity entity;
-			prop_vals_t keys;
-			vector<value> key_vec;
-			
-			int equal {0};
-
-			while(it != end){
-				equal = 0;
-				
-				const table_entity::properties_type& properties = it->properties();
-				for (auto prop_it = properties.begin(); prop_it != properties.end(); ++prop_it) // Cycles through the properties of the current entity
-				{
-					unordered_map<string,string>::const_iterator got = stored_message.find(prop_it->first);
-					if( got != stored_message.end() ){ // A property from the JSON body was found in the entity
-						equal++;
-					}
-				}
-				
-				if( equal == stored_message.size() ){ // All properties from the JSON body were found in the entity
-				cout << "Partition: " << it->partition_key() << " / Row: " << it->row_key() << endl;
-						keys = { make_pair("Partition",value::string(it->partition_key())), make_pair("Row",value::string(it->row_key())) };
-						keys = get_properties(it->properties(), keys);
-						key_vec.push_back(value::object(keys));
-				}
-				
-				++it;
-			}
-			message.reply( status_codes::OK, value::array(key_vec) );
-			return;
+		prop_vals_t values {
+			make_pair("JobId", value::string(job.id)),
+			make_pair("Operation", value::string(job.operation)),
+			make_pair("Table", value::string(job.table)),
+			make_pair("State", value::string(job.state)),
+			make_pair("Processed", value::number(static_cast<uint64_t>(job.processed))),
+			make_pair("ElapsedSeconds", value::number(job.elapsed_seconds)),
+			make_pair("EntitiesPerSecond", value::number(job.rate))
+		};
+		if( job.total > 0 ){
+			values.push_back(make_pair("Total", value::number(static_cast<uint64_t>(job.total))));
 		}
-
-		// GET all entries in table
-		if (paths.size() < 3){
-			table_query query {};
-			table_query_iterator end;
-			table_query_iterator it = table.execute_query(query);
-			vector<value> key_vec;
-			while (it != end) {
-				cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
-				prop_vals_t keys { make_pair("Partition",value::string(it->partition_key())), make_pair("Row", value::string(it->row_key())) };
-				keys = get_properties(it->properties(), keys);
-				key_vec.push_back(value::object(keys));
-				++it;
-			}
-			message.reply(status_codes::OK, value::array(key_vec));
-			return;
+		if( job.eta_seconds >= 0 ){
+			values.push_back(make_pair("EtaSeconds", value::number(job.eta_seconds)));
 		}
-		
-		// GET all entities from a specific partition
-		/*
-			URI Structure:
-			paths[0] = ReadEntityAdmin | paths[1] = <table name> | paths[2] = <partition> | paths[3] = <row>
-		*/
-		if( paths[3] == "*" ){
-				table_query query {};
-				table_query_iterator end;
-				table_query_iterator it = table.execute_query(query);
-				vector<value> key_vec;
-				prop_vals_t keys;
-				while(it != end){ // This while loop iterates through the table until it finds the requested partition
-					if( paths[2] == it->partition_key() ){
-						cout << "GET: " << it->partition_key() << " / " << it->row_key() << endl; 
-						keys = { make_pair("Partition",value::string(it->partition_key())), make_pair("Row",value::string(it->row_key())) };
-						keys = get_properties(it->properties(), keys);
-						key_vec.push_back(value::object(keys));
-					}
-					++it;
-				}
-				
-				if( keys.empty() ){ // The requested partition is not a part of the table
-					message.reply(status_codes::NotFound);
-					return;
-				}
-				
-				message.reply(status_codes::OK, value::array(key_vec));
-				return;
+		if( ! job.error.empty() ){
+			values.push_back(make_pair("Error", value::string(job.error)));
 		}
+		message.reply(status_codes::OK, value::object(values));
+		return;
 	}
 
-  // GET specific entry: Partition == paths[3], Row == paths[4]
-  if (paths.size() != 4) {
-    message.reply (status_codes::BadRequest);
-    return;
-  }
-
-  table_operation retrieve_operation {table_operation::retrieve_entity(paths[2], paths[3])};
-  table_result retrieve_result {table.execute(retrieve_operation)};
-  cout << "HTTP code: " << retrieve_result.http_status_code() << endl;
-  if (retrieve_result.http_status_code() == status_codes::NotFound) {
-    message.reply(status_codes::NotFound);
-    return;
+	// ReadEntityAuth requires 0) ReadEntityAuth Command 1) Table Name, 2) Token, 3) Partition and 4) Row
+  if(op == command::read_entity_auth){
+  	if(path.size() < 5){
+  		message.reply( status_codes::BadRequest);
+  		return;
+  	}
   }
-
-  table_entity entity {retrieve_result.entity()};
-  table_entity::properties_type properties {entity.properties()};
-  
-  // If the entity has any properties, return them as JSON
-  prop_vals_t values (get_properties(properties));
-  if (values.size() > 0){
-    message.reply(status_codes::OK, value::object(values));
-	}
-  else{
-    message.reply(status_codes::OK);
-	}
+	
+	// Check that the table passed in exists in Storage Layer
+  // The other operands are decoded by the handler that uses them; path refers into message, which the continuations keep
+  const string table_name {path[1]};
+  cloud_table table {table_cache.lookup_table(table_name)};
+  finish(message, table_name, table_cache.table_exists_async(table_name)
+    .then([message, table, op, path, table_name] (bool exists) -> pplx::task<void>
+      {
+        if ( ! exists) {
+          message.reply(status_codes::NotFound);
+          return pplx::task_from_result();
+        }
+        switch (op) {
+        /*
+          URI Structure:
+          path[0] = ReadEntityAuth | path[1] = <table name> | path[2] = <token> | path[3] = <partition> | path[4] = <row>
+        */
+        case command::read_entity_auth:
+          return read_token_entity(message);
+        case command::read_entity_admin:
+          return get_json_body_async(message)
+            .then([message, table, table_name, path] (unordered_map<string,string> stored_message)
+              {
+                return read_entities(message, table, table_name, path, stored_message);
+              });
+        case command::read_entities_admin:
+          return read_keys(message, table, table_name);
+        default:
+          return read_entity(message, table, table_name, path);
+        }
+      }));
 }
 
 /*
 	Top-level routine for processing all HTTP POST requests.
 */
 void handle_post(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** POST " << path << endl;
-  auto paths = uri::split_path(path);
+  const RequestPath path {message.request_uri().path()};
+  cout << endl << "**** POST " << path.text() << endl;
+  const command op {path.operation()};
   // Need at least an operation and a table name
-  if (paths.size() < 2) {
+  if (path.size() < 2) {
     message.reply(status_codes::BadRequest);
     return;
   }
 
-  string table_name {paths[1]};
+  string table_name {path[1]};
   cloud_table table {table_cache.lookup_table(table_name)};
 
   // Create table (idempotent if table exists)
-  if (paths[0] == create_table) {
+  if (op == command::create_table_admin) {
     cout << "Create " << table_name << endl;
-    bool created {table.create_if_not_exists()};
-    cout << "Administrative table URI " << table.uri().primary_uri().to_string() << endl;
-    if (created)
-      message.reply(status_codes::Created); // Table is created (RC: 201)
-    else
-      message.reply(status_codes::Accepted); // Table already exists; unchanged (RC: 202)
+    finish(message, table_name, table.create_if_not_exists_async()
+      .then([message, table, table_name] (bool created)
+        {
+          table_cache.set_exists(table_name, true);
+          if (created) {
+            key_filter.reset_empty(table_name);
+            property_index.reset_empty(table_name);
+          }
+          cout << "Administrative table URI " << table.uri().primary_uri().to_string() << endl;
+          if (created)
+            message.reply(status_codes::Created); // Table is created (RC: 201)
+          else
+            message.reply(status_codes::Accepted); // Table already exists; unchanged (RC: 202)
+        }));
   }
   else {
     message.reply(status_codes::BadRequest); // No table name given (RC: 400)
   }
 }
 
-	/*
-		Top-level routine for processing all HTTP PUT requests.
-	*/
-void handle_put(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** PUT " << path << endl;
-  auto paths = uri::split_path(path);
-  // Need at least an operation, table name, partition, and row
-  if (paths.size() < 2) {
-    message.reply(status_codes::BadRequest);
-    return;
+/*
+  Write the properties in body to every entity of a table, as the
+  work of an AddPropertyAdmin (add is true) or UpdatePropertyAdmin job.
+
+  AddPropertyAdmin sets the properties of body that an entity already
+  has, or all of them if it has none. UpdatePropertyAdmin only sets
+  those it already has.
+
+  The table is read a segment at a time, starting from token. The
+  batches of each segment are submitted as soon as it is read, without
+  waiting for those of earlier segments. Once a segment's batches and
+  all earlier ones have finished, a checkpoint is recorded in the
+  journal, from which the job resumes if the server is restarted.
+  scanned is the count of entities already processed before token.
+
+  While the table is scanned, a second scan of only its keys counts
+  the entities, so the job can report an estimated time to finish.
+  Only the estimate is lost if the count fails.
+*/
+void write_properties (JobManager::Job& job, const string& table_name, const unordered_map<string,string>& body, bool add,
+                       const continuation_token& token = continuation_token {}, std::size_t scanned = 0) {
+  cloud_table table {table_cache.lookup_table(table_name)};
+
+  // count is waited for before returning, so may refer to job and counting
+  std::atomic<bool> counting {true};
+  std::shared_ptr<std::size_t> counted {std::make_shared<std::size_t>(0)};
+  table_query count_query {};
+  count_query.set_select_columns(vector<string> {"PartitionKey"});
+  pplx::task<void> count {for_each_segment(table, count_query, [&job, &counting, counted] (const table_query_segment& segment)
+    {
+      *counted += segment.results().size();
+      return counting.load() && ! job.cancelled();
+    })
+    .then([&job, &counting, counted] ()
+      {
+        if (counting.load() && ! job.cancelled())
+          job.set_total(*counted);
+      })};
+
+  /*
+    The point to resume from after a segment, recorded in the
+    journal once done has completed
+  */
+  struct checkpoint {
+    pplx::task<void> done;
+    string token;
+    string partition;
+    string row;
+    std::size_t scanned;
+  };
+  std::deque<checkpoint> checkpoints;
+  // Record the checkpoints whose writes have finished, in order; rethrows a failed write
+  auto record_finished = [&job, &checkpoints] ()
+    {
+      while ( ! checkpoints.empty() && checkpoints.front().done.is_done()) {
+        const checkpoint& c (checkpoints.front());
+        c.done.get();
+        job_journal.record_checkpoint(job.job_id(), c.token, c.partition, c.row, c.scanned);
+        checkpoints.pop_front();
+      }
+    };
+
+  std::exception_ptr failure {};
+  try {
+    // Only the keys and the properties being written are needed
+    table_query query {};
+    select_columns(query, property_names(body));
+    BulkWriter writer {table, bulk_write_concurrency};
+    table_entity entity;
+    job.set_processed(scanned);
+
+    pplx::task<table_query_segment> next {table.execute_query_segmented_async(query, token)};
+    for (;;) {
+      table_query_segment segment {next.get()};
+      const continuation_token segment_end {segment.continuation_token()};
+      if ( ! segment_end.empty()) // Read the next segment while this one is written
+        next = table.execute_query_segmented_async(query, segment_end);
+
+      for (const auto& e : segment.results()) { // This loop iterates through each table entity
+        if (job.cancelled())
+          break;
+        entity = { e.partition_key(), e.row_key() };
+        table_entity::properties_type& properties = entity.properties();
+        const table_entity::properties_type& properties2 = e.properties();
+
+        for (auto prop_it = properties2.begin(); prop_it != properties2.end(); ++prop_it) // Cycles through the properties of the current entity
+        {
+          unordered_map<string,string>::const_iterator got = body.find(prop_it->first);
+          if( got != body.end() && ! prop_it->second.is_null() ){ // A property from the JSON body was found in the entity
+            properties[prop_it->first] = entity_property {got->second};
+          }
+        }
+
+        if( add && properties.empty() ){ // None of the properties were found in the current entity
+          for (const auto& v : body) {
+            properties[v.first] = entity_property {v.second};
+          }
+        }
+        if( ! properties.empty() ){
+          writer.insert_or_merge(entity); // Batched with the other entities of the partition
+        }
+        job.set_processed(++scanned);
+      }
+      if (job.cancelled() || segment_end.empty())
+        break;
+      const string last_partition {segment.results().empty() ? string {} : segment.results().back().partition_key()};
+      const string last_row {segment.results().empty() ? string {} : segment.results().back().row_key()};
+      checkpoints.push_back(checkpoint {writer.submit_pending(), segment_end.next_marker(), last_partition, last_row, scanned});
+      record_finished();
+    }
+    // Batches already collected when the job was cancelled are still written
+    writer.flush();
+    record_finished();
+    cout << "Wrote " << writer.entities() << " entities in " << writer.storage_calls() << " batches" << endl;
+  }
+  catch (...) {
+    failure = std::current_exception();
   }
-	
-	if( paths[0] == update_entity_auth ){
-			if(paths.size() < 5){ // Less than six parameters were provided
-					message.reply(status_codes::BadRequest);
-					return;
-			}
-	}
 
-  cloud_table table {table_cache.lookup_table(paths[1])};
-  if ( ! table.exists()) {
-    message.reply(status_codes::NotFound);
-    return;
+  counting.store(false);
+  try {
+    count.wait();
+  }
+  catch (const std::exception& e) {
+    // Only the estimate of the time to finish is lost
+    cout << "Counting " << table_name << " failed: " << e.what() << endl;
+  }
+  // Observe the failures of checkpoints left unrecorded
+  for (const auto& c : checkpoints) {
+    try {
+      c.done.wait();
+    }
+    catch (const std::exception&) {}
   }
-	
-  unordered_map<string,string> stored_message = get_json_body(message);
 
-	if( paths[0] == add_property_admin ){
-		if(stored_message.size() == 0) message.reply(status_codes::BadRequest); // No JSON object passed in
-		table_query query {};
-		table_query_iterator end;
-		table_query_iterator it = table.execute_query(query);
-		prop_vals_t keys;
-		
-		table_entity entity;
-		bool flag {false};
-
-		while(it != end){ // This while loop iterates through each table entity
-			entity = { it->partition_key(), it->row_key() };
-			table_entity::properties_type& properties = entity.properties();
-			const table_entity::properties_type& properties2 = it->properties();
-			flag = false;
-			
-		  for (auto prop_it = properties2.begin(); prop_it != properties2.end(); ++prop_it) // Cycles through the properties of the current entity
-			{
-				unordered_map<string,string>::const_iterator got = stored_message.find(prop_it->first);
-				if( got != stored_message.end() ){ // A property from the JSON body was found in the entity
-					properties[prop_it->first] = entity_property {got->second};
-					table_operation operation {table_operation::insert_or_merge_entity(entity)};
-					table_result op_result {table.execute(operation)};
-					flag = true;
-				}
-			}
-			
-			if(flag == false){ // The property was not found in the current entity
-				for (const auto v : stored_message) {
-					properties[v.first] = entity_property {v.second};
-				}
-				table_operation operation {table_operation::insert_or_merge_entity(entity)};
-				table_result op_result {table.execute(operation)};
-			}
-			
-			++it;
+  // A failed batch is not applied, but earlier batches were
+  table_entities_written(table_name);
+  if (failure) {
+    job_journal.record_end(job.job_id(), JobManager::state_name(JobManager::state::failed));
+    try {
+      std::rethrow_exception(failure);
+    }
+    catch (const storage_exception& e) {
+      if (table_not_found(e))
+        table_cache.set_exists(table_name, false);
+      throw;
+    }
+  }
+  // A job stopped by a shutdown stays unfinished in the journal, to be resumed
+  if ( ! job.stopping())
+    job_journal.record_end(job.job_id(), JobManager::state_name(job.cancelled() ? JobManager::state::cancelled
+                                                                                : JobManager::state::succeeded));
+}
+
+/*
+  Carry out a PUT request to an existing table once its JSON body,
+  stored_message, has been read
+*/
+pplx::task<void> apply_put (const http_request& message, const cloud_table& table, command op, const string& table_name,
+                            const RequestPath& path, const unordered_map<string,string>& stored_message) {
+	// Table-wide property writes run as background jobs
+	if( op == command::add_property_admin || op == command::update_property_admin ){
+		if(stored_message.size() == 0){ // No JSON object passed in
+			message.reply(status_codes::BadRequest);
+			return pplx::task_from_result();
 		}
-		
-		message.reply(status_codes::OK);
-		return;
+		const bool add {op == command::add_property_admin};
+		if( add ){
+			property_index.merge_all(table_name, property_names(stored_message));
+		}
+		// Journal the job before it can start, so a restart always resumes it
+		string id {jobs.new_id()};
+		job_journal.record_start(id, command_name(op), table_name, stored_message);
+		jobs.submit(command_name(op), table_name, [table_name, stored_message, add] (JobManager::Job& job) {
+			write_properties(job, table_name, stored_message, add);
+		}, id);
+		message.reply(status_codes::Accepted, value::object(prop_vals_t {make_pair("JobId", value::string(id))}));
+		return pplx::task_from_result();
 	}
 	
-	if( paths[0] == update_entity_auth ){
-				status_code token;
-				token = update_with_token(message, tables_endpoint, stored_message);
-				if(token == status_codes::Forbidden){
-					message.reply(status_codes::Forbidden);
-					return;
-				}
-				else if(token == status_codes::InternalError){
-					message.reply(status_codes::InternalError);
-					return;
+	if( op == command::update_entity_auth ){
+				vector<string> key {token_request_key(message)};
+				if( ! key.empty() ){
+					property_index.merge(key[0], key[2], key[3], property_names(stored_message));
 				}
-        else if(token == status_codes::NotFound){
-           message.reply(status_codes::NotFound);
-           return;
-        }
-        message.reply(status_codes::OK);
-        return;
+				return update_with_token_async(message, tables_endpoint, stored_message)
+					.then([message, key] (status_code token) {
+						if( ! key.empty() ){
+							entity_written(key[0], key[2], key[3]);
+						}
+						if(token == status_codes::Forbidden){
+							message.reply(status_codes::Forbidden);
+							return;
+						}
+						else if(token == status_codes::InternalError){
+							message.reply(status_codes::InternalError);
+							return;
+						}
+						else if(token == status_codes::NotFound){
+							message.reply(status_codes::NotFound);
+							return;
+						}
+						else if(token == status_codes::PreconditionFailed){ // If-Match named an old ETag
+							message.reply(status_codes::PreconditionFailed);
+							return;
+						}
+						message.reply(status_codes::OK);
+					});
 	}
-	
-	if( paths[0] == update_property_admin ){
-		if(stored_message.size() == 0) message.reply(status_codes::BadRequest); // No JSON object passed in
-		table_query query {};
-		table_query_iterator end;
-		table_query_iterator it = table.execute_query(query);
-		prop_vals_t keys;
-		table_entity entity;
-		
-		while(it != end){ // This while loop iterates through each table entity
-			entity = { it->partition_key(), it->row_key() };
-			table_entity::properties_type& properties = entity.properties(); // Since properties2 is const, need this to make changes to an entity
-			const table_entity::properties_type& properties2 = it->properties(); // Needed to iterate through the the properties of an entity
-			
-		  for (auto prop_it = properties2.begin(); prop_it != properties2.end(); ++prop_it) // Cycles through the properties of the current entity
-			{
-				unordered_map<string,string>::const_iterator got = stored_message.find(prop_it->first);
-				if( got != stored_message.end() ){ // A property from the JSON body was found in the entity
-					properties[prop_it->first] = entity_property {got->second};
-					table_operation operation {table_operation::insert_or_merge_entity(entity)};
-					table_result op_result {table.execute(operation)};
-				}
-			}
-			
-			++it;
-		}
-		message.reply(status_codes::OK);
-		return;
+
+  /*
+    Update entity; storage errors are answered by finish().
+
+    With an If-Match header the update is a merge conditional on the
+    entity's ETag ("*" for any), which storage refuses with 412 if the
+    entity has changed or 404 if it does not exist. The reply carries
+    the new ETag either way.
+  */
+  if (op != command::update_entity_admin || path.size() < 4) {
+    message.reply(status_codes::BadRequest);
+    return pplx::task_from_result();
+  }
+
+  const string partition {path[2]};
+  const string row {path[3]};
+  table_entity entity {partition, row};
+  cout << "Update " << entity.partition_key() << " / " << entity.row_key() << endl;
+  table_entity::properties_type& properties = entity.properties();
+  for (const auto v : stored_message) {
+		properties[v.first] = entity_property {v.second};
 	}
-	
-  table_entity entity {paths[2], paths[3]};
 
-  // Update entity
-  try {
-    if (paths[0] == update_entity_admin) {
-      cout << "Update " << entity.partition_key() << " / " << entity.row_key() << endl;
-      table_entity::properties_type& properties = entity.properties();
-      for (const auto v : stored_message) {
-				properties[v.first] = entity_property {v.second};
-			}
+  // Record the key and properties before they can exist, so neither the filter nor the index misses them
+  key_filter.add(table_name, partition, row);
+  property_index.merge(table_name, partition, row, property_names(stored_message));
+  const http_headers& headers {message.headers()};
+  auto if_match (headers.find(header_names::if_match));
+  if (if_match != headers.end())
+    entity.set_etag(if_match->second);
+  table_operation operation {if_match == headers.end() ? table_operation::insert_or_merge_entity(entity)
+                                                       : table_operation::merge_entity(entity)};
+  return table.execute_async(operation)
+    .then([message, table_name, partition, row] (pplx::task<table_result> written)
+      {
+        // A failed conditional merge changes nothing, but the cached copy is evidently out of date
+        entity_written(table_name, partition, row);
+        table_result op_result {written.get()};
+        http_response response {status_codes::OK};
+        if ( ! op_result.etag().empty())
+          response.headers().add(header_names::etag, op_result.etag());
+        message.reply(response);
+      });
+}
+
+/*
+  Return true if storage accepts s as a partition or row key.
+  One bad key fails the whole batch it is in, so they are
+  refused beforehand.
+*/
+bool valid_key (const string& s) {
+  return s.size() <= 1024 && s.find_first_of("/\\#?") == string::npos;
+}
 
-      table_operation operation {table_operation::insert_or_merge_entity(entity)};
-      table_result op_result {table.execute(operation)};
+/*
+  Fill in entity from an element of a BulkUpdateEntityAdmin body,
+  returning false if the element is malformed. As in
+  get_json_body_async(), property values that are not strings
+  are stored as their JSON text.
+*/
+bool bulk_entity (const value& item, table_entity& entity) {
+  if ( ! item.is_object() || ! item.has_field("Partition") || ! item.has_field("Row"))
+    return false;
+  const value& partition (item.at("Partition"));
+  const value& row (item.at("Row"));
+  if ( ! partition.is_string() || ! row.is_string() ||
+       ! valid_key(partition.as_string()) || ! valid_key(row.as_string()))
+    return false;
 
-      message.reply(status_codes::OK);
-    }
-    else {
-      message.reply(status_codes::BadRequest);
-    }
+  entity = table_entity {partition.as_string(), row.as_string()};
+  if ( ! item.has_field("Properties"))
+    return true;
+  const value& properties (item.at("Properties"));
+  if ( ! properties.is_object())
+    return false;
+  for (const auto& p : properties.as_object()) {
+    if (p.first.empty() || p.first == "PartitionKey" || p.first == "RowKey" || p.first == "Timestamp")
+      return false;
+    entity.properties()[p.first] = entity_property {p.second.is_string() ? p.second.as_string() : p.second.serialize()};
+  }
+  return true;
+}
+
+/*
+  Outcome of one element of a BulkUpdateEntityAdmin body
+*/
+struct bulk_result {
+  bool parsed;
+  string partition;
+  string row;
+  status_code status;
+};
+
+/*
+  An entity group transaction of a bulk update, with the positions
+  in the body of the elements it writes
+*/
+struct bulk_batch {
+  table_batch_operation operation;
+  vector<std::size_t> positions;
+  std::size_t bytes;
+};
+
+/*
+  Reply to a BulkUpdateEntityAdmin request.
+
+  The entities are grouped by partition into entity group transactions
+  within the limits of BulkWriter. A transaction holds each row at most
+  once, so a row written twice is written in the body's order.
+  The transactions of a partition run one after the other, while up to
+  bulk_write_concurrency partitions are written at once.
+
+  The reply is 200 with an array holding, for each element of the
+  body in order, its keys and the status of its write: 200 if it was
+  written, 400 if it was malformed, else the status of its failed
+  transaction, none of which was applied.
+*/
+pplx::task<void> bulk_update (const http_request& message, const cloud_table& table, const string& table_name) {
+  if ( ! has_json_body(message)) {
+    message.reply(status_codes::BadRequest);
+    return pplx::task_from_result();
   }
-  catch (const storage_exception& e)
-  {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    message.reply(status_codes::InternalError);
+  return message.extract_json(true)
+    .then([message, table, table_name] (value body) -> pplx::task<void>
+      {
+        if ( ! body.is_array()) {
+          message.reply(status_codes::BadRequest);
+          return pplx::task_from_result();
+        }
+        const web::json::array& items (body.as_array());
+        if (items.size() > max_bulk_entities) {
+          message.reply(status_codes::RequestEntityTooLarge);
+          return pplx::task_from_result();
+        }
+
+        // Each transaction fills in only its own elements, so they need no lock
+        std::shared_ptr<vector<bulk_result>> results {std::make_shared<vector<bulk_result>>()};
+        results->reserve(items.size());
+        vector<string> partitions; // In order of first appearance
+        unordered_map<string,vector<bulk_batch>> batches;
+        for (const value& item : items) {
+          table_entity entity;
+          if ( ! bulk_entity(item, entity)) {
+            results->push_back(bulk_result {false, string {}, string {}, status_codes::BadRequest});
+            continue;
+          }
+          const string& partition (entity.partition_key());
+          const string& row (entity.row_key());
+          results->push_back(bulk_result {true, partition, row, status_codes::OK});
+
+          // Record the key and properties before they can exist, as apply_put() does
+          vector<string> names;
+          for (const auto& p : entity.properties())
+            names.push_back(p.first);
+          key_filter.add(table_name, partition, row);
+          property_index.merge(table_name, partition, row, names);
+
+          vector<bulk_batch>& group (batches[partition]);
+          if (group.empty())
+            partitions.push_back(partition);
+          const std::size_t bytes {BulkWriter::entity_bytes(entity)};
+          bool start {group.empty()};
+          if ( ! start) {
+            const table_batch_operation::operations_type& ops (group.back().operation.operations());
+            start = ops.size() == BulkWriter::max_batch_operations ||
+              group.back().bytes + bytes > BulkWriter::max_batch_bytes ||
+              std::any_of(ops.begin(), ops.end(), [&row] (const table_operation& op)
+                {
+                  return op.entity().row_key() == row;
+                });
+          }
+          if (start)
+            group.push_back(bulk_batch {table_batch_operation {}, vector<std::size_t> {}, 0});
+          group.back().operation.insert_or_merge_entity(entity);
+          group.back().positions.push_back(results->size() - 1);
+          group.back().bytes += bytes;
+        }
+        cout << "Bulk update of " << items.size() << " entities in " << partitions.size() << " partitions" << endl;
+
+        // Each partition's transactions go in one chain, which runs them in order
+        const std::size_t chain_count {std::min(bulk_write_concurrency, partitions.size())};
+        vector<pplx::task<void>> chains (chain_count, pplx::task_from_result());
+        for (std::size_t i = 0; i < partitions.size(); ++i) {
+          pplx::task<void>& chain (chains[i % chain_count]);
+          for (const bulk_batch& batch : batches[partitions[i]]) {
+            chain = chain.then([table, table_name, batch, results] ()
+              {
+                return table.execute_batch_async(batch.operation)
+                  .then([table_name, batch, results] (pplx::task<vector<table_result>> done)
+                    {
+                      status_code status {status_codes::OK};
+                      try {
+                        done.get();
+                      }
+                      catch (const storage_exception& e) {
+                        cout << "Azure Table Storage error: " << e.what() << endl;
+                        if (table_not_found(e))
+                          table_cache.set_exists(table_name, false);
+                        status = e.result().http_status_code();
+                        if (status == 0) // No response
+                          status = status_codes::InternalError;
+                      }
+                      catch (const std::exception& e) {
+                        cout << "Bulk update failed: " << e.what() << endl;
+                        status = status_codes::InternalError;
+                      }
+                      // Evict what this batch wrote now, not once the whole update is done
+                      for (std::size_t position : batch.positions) {
+                        bulk_result& r ((*results)[position]);
+                        entity_written(table_name, r.partition, r.row);
+                        r.status = status;
+                      }
+                    });
+              });
+          }
+        }
+
+        return pplx::when_all(chains.begin(), chains.end())
+          .then([message, table_name, results] ()
+            {
+              vector<value> statuses;
+              for (const bulk_result& r : *results) {
+                prop_vals_t values {};
+                if (r.parsed) {
+                  values.push_back(make_pair("Partition", value::string(r.partition)));
+                  values.push_back(make_pair("Row", value::string(r.row)));
+                }
+                values.push_back(make_pair("Status", value::number(r.status)));
+                statuses.push_back(value::object(values));
+              }
+              reply_json(message, status_codes::OK, value::array(statuses));
+            });
+      });
+}
+
+	/*
+		Top-level routine for processing all HTTP PUT requests.
+	*/
+void handle_put(http_request message) {
+  const RequestPath path {message.request_uri().path()};
+  cout << endl << "**** PUT " << path.text() << endl;
+  const command op {path.operation()};
+  // Need at least an operation, table name, partition, and row
+  if (path.size() < 2) {
+    message.reply(status_codes::BadRequest);
+    return;
   }
+	
+	if( op == command::update_entity_auth ){
+			if(path.size() < 5){ // Less than six parameters were provided
+					message.reply(status_codes::BadRequest);
+					return;
+			}
+	}
 
+  const string table_name {path[1]};
+  cloud_table table {table_cache.lookup_table(table_name)};
+  finish(message, table_name, table_cache.table_exists_async(table_name)
+    .then([message, table, op, path, table_name] (bool exists) -> pplx::task<void>
+      {
+        if ( ! exists) {
+          message.reply(status_codes::NotFound);
+          return pplx::task_from_result();
+        }
+        // Its body is an array, not an object
+        if (op == command::bulk_update_entity_admin)
+          return bulk_update(message, table, table_name);
+        return get_json_body_async(message)
+          .then([message, table, op, table_name, path] (unordered_map<string,string> stored_message)
+            {
+              return apply_put(message, table, op, table_name, path, stored_message);
+            });
+      }));
 }
 
 /*
   Top-level routine for processing all HTTP DELETE requests.
 */
 void handle_delete(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** DELETE " << path << endl;
-  auto paths = uri::split_path(path);
+  const RequestPath path {message.request_uri().path()};
+  cout << endl << "**** DELETE " << path.text() << endl;
+  const command op {path.operation()};
   // Need at least an operation and table name
-  if (paths.size() < 2) {
+  if (path.size() < 2) {
 		message.reply(status_codes::BadRequest);
 		return;
   }
 
-  string table_name {paths[1]};
+  // Cancel a background job; writes it has already made remain
+  if (op == command::cancel_job_admin) {
+    message.reply(jobs.cancel(path[1]) ? status_codes::OK : status_codes::NotFound);
+    return;
+  }
+
+  string table_name {path[1]};
   cloud_table table {table_cache.lookup_table(table_name)};
 
   // Delete table
-  if (paths[0] == delete_table) {
+  if (op == command::delete_table_admin) {
     cout << "Delete " << table_name << endl;
-    if ( ! table.exists()) {
-      message.reply(status_codes::NotFound);
-    }
-    table.delete_table();
-    table_cache.delete_entry(table_name);
-    message.reply(status_codes::OK);
+    finish(message, table_name, table_cache.table_exists_async(table_name)
+      .then([message, table, table_name] (bool exists) mutable -> pplx::task<void>
+        {
+          if ( ! exists) {
+            message.reply(status_codes::NotFound);
+            return pplx::task_from_result();
+          }
+          return table.delete_table_async()
+            .then([message, table_name] ()
+              {
+                table_cache.set_exists(table_name, false);
+                entity_cache.invalidate_table(table_name);
+                key_filter.drop_table(table_name);
+                property_index.drop_table(table_name);
+                message.reply(status_codes::OK);
+              });
+        }));
   }
 	
   // Delete entity
-  else if (paths[0] == delete_entity) {
+  else if (op == command::delete_entity_admin) {
     // For delete entity, also need partition and row
-    if (paths.size() < 4) {
+    if (path.size() < 4) {
 			message.reply(status_codes::BadRequest);
 			return;
     }
-    table_entity entity {paths[2], paths[3]};
+    const string partition {path[2]};
+    const string row {path[3]};
+    table_entity entity {partition, row};
     cout << "Delete " << entity.partition_key() << " / " << entity.row_key()<< endl;
 
     table_operation operation {table_operation::delete_entity(entity)};
-    table_result op_result {table.execute(operation)};
+    finish(message, table_name, table.execute_async(operation)
+      .then([message, table_name, partition, row] (table_result op_result)
+        {
+          entity_written(table_name, partition, row);
 
-    int code {op_result.http_status_code()};
-    if (code == status_codes::OK || 
-			code == status_codes::NoContent)
-      message.reply(status_codes::OK);
-    else
-      message.reply(code);
+          int code {op_result.http_status_code()};
+          if (code == status_codes::OK || 
+              code == status_codes::NoContent) {
+            property_index.remove(table_name, partition, row);
+            message.reply(status_codes::OK);
+          }
+          else
+            message.reply(code);
+        }));
   }
   else {
     message.reply(status_codes::BadRequest);
   }
 }
 
+/*
+  Resume the jobs left unfinished when the server last stopped
+*/
+void resume_jobs () {
+  for (const auto& unfinished : job_journal.recover()) {
+    const command op {find_command(unfinished.operation.data(), unfinished.operation.size())};
+    const bool add {op == command::add_property_admin};
+    if ( ! add && op != command::update_property_admin)
+      continue;
+    cout << "Resuming job " << unfinished.id << ": " << unfinished.operation << " " << unfinished.table
+         << " after " << unfinished.scanned << " entities" << endl;
+    const string table_name {unfinished.table};
+    const unordered_map<string,string> properties {unfinished.properties};
+    const continuation_token token {unfinished.token};
+    const std::size_t scanned {unfinished.scanned};
+    jobs.submit(unfinished.operation, table_name, [table_name, properties, add, token, scanned] (JobManager::Job& job) {
+      write_properties(job, table_name, properties, add, token, scanned);
+    }, unfinished.id);
+  }
+}
+
+/*
+  Preload the caches before accepting requests.
+
+  Each line of the warm-up file names what to load, as a
+  ReadEntityAdmin path without the command:
+
+    <table>                    Open the table and check that it exists
+    <table>/<partition>/<row>  Also read one entity, or every entity
+                               of the partition if <row> is "*"
+
+  Blank lines and lines starting with '#' are ignored. Partitions
+  and rows are read concurrently; warm_up() returns when all reads
+  have finished. Key filters are rebuilt in the background.
+*/
+void warm_up (const string& file_name) {
+  std::ifstream warm_file {file_name};
+  if ( ! warm_file) {
+    cout << "Cannot open warm-up file " << file_name << endl;
+    return;
+  }
+
+  vector<pplx::task<void>> loads;
+  string line;
+  while (getline(warm_file, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    vector<string> parts {uri::split_path(line)};
+    if (parts.empty())
+      continue;
+
+    const string table_name {parts[0]};
+    cloud_table table {table_cache.lookup_table(table_name)};
+    if ( ! table_cache.table_exists(table_name)) {
+      cout << "Warm-up: no table " << table_name << endl;
+      continue;
+    }
+    if (key_filter.needs_rebuild(table_name))
+      rebuild_key_filter(table_name);
+    if (parts.size() != 3)
+      continue;
+
+    const string partition {parts[1]};
+    const string row {parts[2]};
+    if (row == "*") {
+      loads.push_back(pplx::create_task([table, table_name, partition] ()
+        {
+          const EntityCache::read_mark mark {entity_cache.mark()};
+          vector<table_entity> entities {read_partition(table, partition)};
+          entity_cache.insert_partition(table_name, partition, entities, mark);
+          for (const auto& e : entities)
+            entity_cache.insert(table_name, e, mark);
+        }));
+    }
+    else {
+      const EntityCache::read_mark mark {entity_cache.mark()};
+      loads.push_back(table.execute_async(table_operation::retrieve_entity(partition, row))
+        .then([table_name, partition, row, mark] (table_result result)
+          {
+            if (result.http_status_code() == status_codes::NotFound)
+              entity_cache.insert_missing(table_name, partition, row, mark);
+            else
+              entity_cache.insert(table_name, result.entity(), mark);
+          }));
+    }
+  }
+
+  for (auto& load : loads) {
+    try {
+      load.get();
+    }
+    catch (const std::exception& e) { // A failed read only leaves its entries uncached
+      cout << "Warm-up read failed: " << e.what() << endl;
+    }
+  }
+  cout << "Warm-up loaded " << loads.size() << " partitions and rows" << endl;
+}
+
+/*
+  Choose the executor lane of a request by its route. Table scans
+  (ReadEntityAdmin of a table, a partition or a property filter, paged
+  or not), table-wide writes and bulk updates go in the bulk lane, where
+  they cannot delay point reads and writes. The jobs that carry out table-wide
+  writes are further limited by the job workers and bulk_write_concurrency.
+*/
+RequestExecutor::lane request_lane (const http_request& message) {
+  const RequestPath path {message.request_uri().path()};
+  if (path.size() < 2)
+    return RequestExecutor::lane::interactive;
+  const command op {path.operation()};
+  if (message.method() == methods::PUT &&
+      (op == command::add_property_admin || op == command::update_property_admin ||
+       op == command::bulk_update_entity_admin))
+    return RequestExecutor::lane::bulk;
+  if (message.method() == methods::GET && op == command::read_entity_admin) {
+    // A '*' spelled %2A is missed, which only costs that scan the bulk lane
+    if (path.size() == 2 || has_json_body(message) ||
+        (path.size() == 4 && path.segment(3).size == 1 && path.segment(3).data[0] == '*'))
+      return RequestExecutor::lane::bulk;
+  }
+  return RequestExecutor::lane::interactive;
+}
+
 /*
   Main server routine
 
+  Usage: basicserver [warm-up file [bulk write concurrency]]
+
   Install handlers for the HTTP requests and open the listener,
-  which processes each request asynchronously.
+  which processes each request asynchronously. If a warm-up
+  file is given, the listener is only opened once the caches
+  have been loaded from it (see warm_up()). Use "" for no file.
+
+  The bulk write concurrency limits the entity group transactions
+  AddPropertyAdmin, UpdatePropertyAdmin and each BulkUpdateEntityAdmin
+  run in parallel.
+  Jobs still running at shutdown are stopped and, like any left
+  unfinished by a crash, resumed from basicserver.journal at the
+  next start.
   
   Wait for a carriage return, then shut the server down.
 */
@@ -585,18 +2072,35 @@ int main (int argc, char const * argv[]) {
   cout << "Parsing connection string" << endl;
   table_cache.init (storage_connection_string);
 
+  if (argc > 2 && std::atoi(argv[2]) > 0)
+    bulk_write_concurrency = static_cast<std::size_t>(std::atoi(argv[2]));
+
+  if (argc > 1 && argv[1][0] != '\0') {
+    cout << "Warming up from " << argv[1] << endl;
+    warm_up (argv[1]);
+  }
+
+  resume_jobs();
+
   cout << "Opening listener" << endl;
-  listener.support(methods::GET, &handle_get);
-  listener.support(methods::POST, &handle_post);
-  listener.support(methods::PUT, &handle_put);
-  listener.support(methods::DEL, &handle_delete);
+  listener.support(methods::GET, executor.admit(&handle_get, &request_lane));
+  listener.support(methods::POST, executor.admit(&handle_post));
+  listener.support(methods::PUT, executor.admit(&handle_put, &request_lane));
+  listener.support(methods::DEL, executor.admit(&handle_delete));
   listener.open().wait(); // Wait for listener to complete starting
+  cout << "Ready" << endl;
 
   cout << "Enter carriage return to stop server." << endl;
   string line;
   getline(std::cin, line);
 
-  // Shut it down
+  // Shut it down; queued requests are refused and those being handled are answered
+  executor.stop();
   listener.close().wait();
+  jobs.stop();
+  cout << "Point requests: " << executor.get_metrics(RequestExecutor::lane::interactive) << endl;
+  cout << "Scans and table-wide writes: " << executor.get_metrics(RequestExecutor::lane::bulk) << endl;
+  cout << "Entity cache: " << entity_cache.hits() << " hits, " << entity_cache.misses() << " misses, "
+       << entity_cache.rejections() << " rejected, " << entity_cache.bytes() << " bytes" << endl;
   cout << "Closed" << endl;
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "BulkWriter.h"
+
+#include <cstddef>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/table.h>
+
+using azure::storage::cloud_table;
+using azure::storage::edm_type;
+using azure::storage::table_batch_operation;
+using azure::storage::table_entity;
+using azure::storage::table_result;
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+BulkWriter::BulkWriter (const cloud_table& table, size_t max_in_flight) :
+  table {table}, batch {}, partition {}, batch_bytes {0},
+  max_in_flight {max_in_flight == 0 ? 1 : max_in_flight},
+  in_flight {}, partition_tails {}, failure {}, written {0}, calls {0}
+{}
+
+BulkWriter::~BulkWriter () {
+  // The batches update written, so must finish before it is destroyed
+  while ( ! in_flight.empty())
+    wait_oldest();
+}
+
+/*
+  Rough size of an entity in the batch request body, erring
+  high: property values other than strings are short.
+*/
+size_t BulkWriter::entity_bytes(const table_entity& entity) {
+  size_t bytes {512 + entity.partition_key().size() + entity.row_key().size()};
+  for (const auto& p : entity.properties()) {
+    bytes += 64 + p.first.size();
+    if (p.second.property_type() == edm_type::string)
+      bytes += p.second.string_value().size();
+    else
+      bytes += 64;
+  }
+  return bytes;
+}
+
+/*
+  Wait for the oldest outstanding batch, recording its failure
+*/
+void BulkWriter::wait_oldest() {
+  pplx::task<void> oldest {in_flight.front()};
+  in_flight.pop_front();
+  try {
+    oldest.get();
+  }
+  catch (...) {
+    if ( ! failure)
+      failure = std::current_exception();
+  }
+}
+
+void BulkWriter::throw_if_failed() {
+  if (failure)
+    std::rethrow_exception(failure);
+}
+
+void BulkWriter::submit() {
+  const size_t count {batch.size()};
+  cloud_table t {table};
+  table_batch_operation ops {batch};
+  std::atomic<size_t>& done (written);
+
+  pplx::task<void> previous {pplx::task_from_result()};
+  auto tail (partition_tails.find(partition));
+  if (tail != partition_tails.end())
+    previous = tail->second;
+  pplx::task<void> next {previous.then([t, ops, count, &done] (pplx::task<void> before)
+    {
+      before.get(); // Do not write past a failed batch of the partition
+      return t.execute_batch_async(ops).then([count, &done] (vector<table_result>)
+        {
+          done += count;
+        });
+    })};
+
+  partition_tails[partition] = next;
+  in_flight.push_back(next);
+  ++calls;
+  batch = table_batch_operation {};
+  batch_bytes = 0;
+
+  // Forget partitions whose batches have all finished
+  if (partition_tails.size() > 4 * max_in_flight) {
+    for (auto p = partition_tails.begin(); p != partition_tails.end(); ) {
+      if (p->second.is_done())
+        p = partition_tails.erase(p);
+      else
+        ++p;
+    }
+  }
+  while (in_flight.size() > max_in_flight || ( ! in_flight.empty() && in_flight.front().is_done()))
+    wait_oldest();
+}
+
+void BulkWriter::insert_or_merge(const table_entity& entity) {
+  throw_if_failed();
+  size_t bytes {entity_bytes(entity)};
+  if (batch.size() > 0 &&
+      (entity.partition_key() != partition ||
+       batch.size() == max_batch_operations ||
+       batch_bytes + bytes > max_batch_bytes))
+    submit();
+  if (batch.size() == 0)
+    partition = entity.partition_key();
+  batch.insert_or_merge_entity(entity);
+  batch_bytes += bytes;
+}
+
+pplx::task<void> BulkWriter::submit_pending() {
+  throw_if_failed();
+  if (batch.size() > 0)
+    submit();
+  // Batches no longer in flight have succeeded, or failure would be set
+  throw_if_failed();
+  vector<pplx::task<void>> pending (in_flight.begin(), in_flight.end());
+  return pplx::when_all(pending.begin(), pending.end());
+}
+
+void BulkWriter::flush() {
+  throw_if_failed();
+  if (batch.size() > 0)
+    submit();
+  while ( ! in_flight.empty())
+    wait_oldest();
+  partition_tails.clear();
+  throw_if_failed();
+}
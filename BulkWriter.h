@@ -0,0 +1,90 @@
+#ifndef BulkWriter_h
+#define BulkWriter_h
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <string>
+#include <unordered_map>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/table.h>
+
+/*
+  Writes many entities of one table with entity group transactions
+  instead of one storage call per entity.
+
+  Consecutive writes to the same partition are collected into a
+  batch, which is submitted when it reaches the service limits
+  (100 operations or about 4 MB) or when a write to another partition
+  arrives. Entities should therefore be written in partition order,
+  as a table query returns them.
+
+  Batches are submitted asynchronously, with at most max_in_flight
+  outstanding; insert_or_merge() blocks while that many are running.
+  Batches of different partitions run concurrently, while each batch
+  of a partition starts only after the previous one of that partition
+  has succeeded, so later writes to an entity are applied last.
+
+  A batch is applied atomically. Once one fails, no further batches
+  are started and insert_or_merge() or flush() rethrows its
+  storage_exception. Batches that had already succeeded remain.
+*/
+class BulkWriter {
+public:
+  static constexpr std::size_t max_batch_operations {100};
+  static constexpr std::size_t max_batch_bytes {4 * 1000 * 1000};
+private:
+  azure::storage::cloud_table table;
+  azure::storage::table_batch_operation batch;
+  std::string partition;
+  std::size_t batch_bytes;
+  std::size_t max_in_flight;
+  std::deque<pplx::task<void>> in_flight; // Oldest first
+  std::unordered_map<std::string,pplx::task<void>> partition_tails; // Last batch submitted per partition
+  std::exception_ptr failure;
+  std::atomic<std::size_t> written;
+  std::size_t calls;
+
+  void submit();
+  void wait_oldest();
+  void throw_if_failed();
+public:
+  BulkWriter (const azure::storage::cloud_table& table, std::size_t max_in_flight = 1);
+
+  // Rough size of an entity in a batch request body, erring high
+  static std::size_t entity_bytes(const azure::storage::table_entity& entity);
+
+  /*
+    Waits for the batches already submitted, but does not submit
+    the last one; call flush() for that.
+  */
+  ~BulkWriter ();
+
+  BulkWriter (const BulkWriter&) = delete;
+  BulkWriter& operator= (const BulkWriter&) = delete;
+
+  void insert_or_merge(const azure::storage::table_entity& entity);
+
+  /*
+    Submit the writes collected so far without waiting for them.
+    The task returned completes once every batch submitted until
+    now has finished, and fails if any of them failed.
+  */
+  pplx::task<void> submit_pending();
+
+  /*
+    Submit the writes collected so far and wait for every batch
+    to finish. Call after the last write.
+  */
+  void flush();
+
+  // Entities written by successful batches
+  std::size_t entities() const { return written.load(); }
+  // Batches submitted
+  std::size_t storage_calls() const { return calls; }
+};
+
+#endif
@@ -0,0 +1,208 @@
+/*
+  Compression of HTTP bodies with zlib
+ */
+
+#include "Compression.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+using std::string;
+using std::vector;
+
+using web::http::header_names;
+using web::http::http_headers;
+using web::http::http_request;
+using web::http::http_response;
+using web::http::status_code;
+
+using web::json::value;
+
+namespace {
+  // Output is produced this many bytes at a time
+  constexpr std::size_t chunk_size {16 * 1024};
+
+  string trim (const string& s) {
+    const std::size_t start {s.find_first_not_of(" \t")};
+    if (start == string::npos)
+      return string {};
+    return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+  }
+
+  string lower (string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [] (unsigned char c) { return std::tolower(c); });
+    return s;
+  }
+}
+
+/*
+  Parse each element of the header, "coding[;q=weight]", keeping the
+  weight of gzip, deflate and the wildcard "*", which stands for any
+  coding not listed. Weights that do not parse count as 1.
+*/
+content_coding negotiate_coding(const http_headers& request_headers) {
+  auto accept (request_headers.find(header_names::accept_encoding));
+  if (accept == request_headers.end())
+    return content_coding::identity;
+
+  double gzip_q {-1};
+  double deflate_q {-1};
+  double any_q {-1};
+  const string& list (accept->second);
+  for (std::size_t start = 0; start <= list.size(); ) {
+    std::size_t end {list.find(',', start)};
+    if (end == string::npos)
+      end = list.size();
+    const string element {list.substr(start, end - start)};
+    start = end + 1;
+
+    const std::size_t params {element.find(';')};
+    const string name {lower(trim(element.substr(0, params)))};
+    double q {1};
+    if (params != string::npos) {
+      const string param {lower(trim(element.substr(params + 1)))};
+      if (param.compare(0, 2, "q=") == 0) {
+        try {
+          q = std::stod(param.substr(2));
+        }
+        catch (const std::exception&) {
+        }
+      }
+    }
+    if (name == "gzip" || name == "x-gzip")
+      gzip_q = q;
+    else if (name == "deflate")
+      deflate_q = q;
+    else if (name == "*")
+      any_q = q;
+  }
+  if (gzip_q < 0)
+    gzip_q = std::max(any_q, 0.0);
+  if (deflate_q < 0)
+    deflate_q = std::max(any_q, 0.0);
+
+  if (gzip_q > 0 && gzip_q >= deflate_q)
+    return content_coding::gzip;
+  if (deflate_q > 0)
+    return content_coding::deflate;
+  return content_coding::identity;
+}
+
+string coding_name(content_coding coding) {
+  switch (coding) {
+  case content_coding::gzip:
+    return "gzip";
+  case content_coding::deflate:
+    return "deflate";
+  default:
+    return "identity";
+  }
+}
+
+Deflater::Deflater (content_coding coding, int level) :
+  stream {}
+{
+  if (coding == content_coding::identity)
+    throw std::invalid_argument {"Deflater needs gzip or deflate"};
+  // Window bits above 15 select the gzip wrapper instead of zlib's
+  const int window_bits {coding == content_coding::gzip ? 15 + 16 : 15};
+  if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::runtime_error {"deflateInit2 failed"};
+}
+
+Deflater::~Deflater () {
+  deflateEnd(&stream);
+}
+
+string Deflater::run(const char* data, std::size_t size, int flush) {
+  string out {};
+  char chunk[chunk_size];
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream.avail_in = static_cast<uInt>(size);
+  // zlib has consumed all the input once it leaves room in the output
+  do {
+    stream.next_out = reinterpret_cast<Bytef*>(chunk);
+    stream.avail_out = chunk_size;
+    if (deflate(&stream, flush) == Z_STREAM_ERROR)
+      throw std::runtime_error {"deflate failed"};
+    out.append(chunk, chunk_size - stream.avail_out);
+  } while (stream.avail_out == 0);
+  return out;
+}
+
+string Deflater::compress(const string& data) {
+  return run(data.data(), data.size(), Z_NO_FLUSH);
+}
+
+string Deflater::finish() {
+  return run(nullptr, 0, Z_FINISH);
+}
+
+string decompress(const string& data) {
+  z_stream stream {};
+  // 32 added to the window bits detects a gzip or zlib header
+  if (inflateInit2(&stream, 15 + 32) != Z_OK)
+    throw std::runtime_error {"inflateInit2 failed"};
+
+  string out {};
+  char chunk[chunk_size];
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = static_cast<uInt>(data.size());
+  int result {Z_OK};
+  while (result != Z_STREAM_END) {
+    stream.next_out = reinterpret_cast<Bytef*>(chunk);
+    stream.avail_out = chunk_size;
+    result = inflate(&stream, Z_NO_FLUSH);
+    if (result != Z_OK && result != Z_STREAM_END) {
+      inflateEnd(&stream);
+      throw std::runtime_error {result == Z_BUF_ERROR ? "Compressed body is truncated" : "Compressed body is invalid"};
+    }
+    out.append(chunk, chunk_size - stream.avail_out);
+  }
+  inflateEnd(&stream);
+  return out;
+}
+
+void set_json_body(const http_request& message, http_response& response, const string& json_text) {
+  if (json_text.size() < compression_threshold) {
+    response.set_body(json_text, "application/json");
+    return;
+  }
+
+  // Caches must not give this response to clients that accept other codings
+  response.headers().add(header_names::vary, header_names::accept_encoding);
+  const content_coding coding {negotiate_coding(message.headers())};
+  if (coding == content_coding::identity) {
+    response.set_body(json_text, "application/json");
+    return;
+  }
+  Deflater deflater {coding};
+  string packed {deflater.compress(json_text)};
+  packed += deflater.finish();
+  response.headers().add(header_names::content_encoding, coding_name(coding));
+  response.set_body(vector<unsigned char> (packed.begin(), packed.end()));
+  response.headers().set_content_type("application/json");
+}
+
+void set_json_body(const http_request& message, http_response& response, const value& body) {
+  set_json_body(message, response, body.serialize());
+}
+
+void reply_json(const http_request& message, status_code code, const string& json_text) {
+  http_response response {code};
+  set_json_body(message, response, json_text);
+  message.reply(response);
+}
+
+void reply_json(const http_request& message, status_code code, const value& body) {
+  reply_json(message, code, body.serialize());
+}
@@ -0,0 +1,87 @@
+#ifndef Compression_h
+#define Compression_h
+
+#include <cstddef>
+#include <string>
+
+#include <zlib.h>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+/*
+  Content codings of HTTP bodies (RFC 7231, section 3.1.2.1)
+*/
+enum class content_coding { identity, gzip, deflate };
+
+/*
+  Bodies shorter than this are sent uncompressed: below about one
+  packet, compression saves no round trips but still costs CPU.
+*/
+constexpr std::size_t compression_threshold {1400};
+
+/*
+  Return the coding to use for a response, given the Accept-Encoding
+  header of the request: gzip if acceptable, else deflate, else
+  identity. Codings given q=0 are not acceptable.
+*/
+content_coding negotiate_coding(const web::http::http_headers& request_headers);
+
+// The name of a coding in Content-Encoding and Accept-Encoding headers
+std::string coding_name(content_coding coding);
+
+/*
+  Incremental compressor for one body in the gzip or deflate (zlib)
+  format. compress() returns the output produced so far, which zlib
+  holds back until it has enough input for a block; finish() returns
+  the rest. Throws std::runtime_error if zlib fails.
+*/
+class Deflater {
+private:
+  z_stream stream;
+
+  std::string run(const char* data, std::size_t size, int flush);
+public:
+  Deflater (content_coding coding, int level = Z_DEFAULT_COMPRESSION);
+  ~Deflater ();
+
+  Deflater (const Deflater&) = delete;
+  Deflater& operator= (const Deflater&) = delete;
+
+  std::string compress(const std::string& data);
+  std::string finish();
+};
+
+/*
+  Decompress a whole body in the gzip or deflate (zlib) format,
+  detecting which from its header. Throws std::runtime_error if
+  the body is not valid.
+*/
+std::string decompress(const std::string& data);
+
+/*
+  Set body as the JSON body of response to message, compressed with
+  the coding negotiated from message's Accept-Encoding header if it
+  is at least compression_threshold bytes.
+*/
+void set_json_body(const web::http::http_request& message,
+                   web::http::http_response& response,
+                   const web::json::value& body);
+
+// As above, for a body already serialized as JSON text
+void set_json_body(const web::http::http_request& message,
+                   web::http::http_response& response,
+                   const std::string& json_text);
+
+/*
+  Reply to message with code and body, compressed as by set_json_body()
+*/
+void reply_json(const web::http::http_request& message,
+                web::http::status_code code,
+                const web::json::value& body);
+
+void reply_json(const web::http::http_request& message,
+                web::http::status_code code,
+                const std::string& json_text);
+
+#endif
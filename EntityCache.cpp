@@ -0,0 +1,468 @@
+#include "EntityCache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <was/table.h>
+
+using azure::storage::edm_type;
+using azure::storage::table_entity;
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::unique_ptr;
+using std::vector;
+
+using std::chrono::steady_clock;
+
+/*
+  Rough per-object costs used to estimate the memory held by an entry
+*/
+constexpr size_t node_overhead {160}; // List node, index entry and bookkeeping
+constexpr size_t entity_overhead {sizeof(table_entity)};
+constexpr size_t property_overhead {64}; // Hash node and entity_property
+constexpr size_t token_overhead {sizeof(string)};
+
+constexpr unsigned counter_max {15};
+
+FrequencySketch::FrequencySketch (size_t expected_keys) :
+  counters {},
+  width {1},
+  additions {0},
+  sample_size {0}
+{
+  while (width < expected_keys)
+    width <<= 1;
+  counters.assign(depth * width, 0);
+  sample_size = 10 * width;
+}
+
+size_t FrequencySketch::index(size_t hash, unsigned row) const {
+  static const uint64_t seeds[depth] {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+    0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL };
+  uint64_t x {(static_cast<uint64_t>(hash) + seeds[row]) * 0x9e3779b97f4a7c15ULL};
+  x ^= x >> 32;
+  return row * width + (x & (width - 1));
+}
+
+void FrequencySketch::increment(size_t hash) {
+  bool added {false};
+  for (unsigned row = 0; row < depth; ++row) {
+    std::uint8_t& c (counters[index(hash, row)]);
+    if (c < counter_max) {
+      ++c;
+      added = true;
+    }
+  }
+  if (added && ++additions >= sample_size) {
+    for (auto& c : counters)
+      c >>= 1;
+    additions /= 2;
+  }
+}
+
+unsigned FrequencySketch::frequency(size_t hash) const {
+  unsigned f {counter_max};
+  for (unsigned row = 0; row < depth; ++row)
+    f = std::min<unsigned>(f, counters[index(hash, row)]);
+  return f;
+}
+
+EntityCache::shard::shard (size_t expected_keys) :
+  lock {},
+  lru {},
+  bytes {{0, 0, 0}},
+  index {},
+  sketch {expected_keys},
+  generation {0}
+  {}
+
+EntityCache::EntityCache (size_t capacity_bytes,
+                          steady_clock::duration entry_ttl) :
+  shards {},
+  window_capacity {0},
+  main_capacity {0},
+  protected_capacity {0},
+  ttl {entry_ttl},
+  hit_count {0},
+  miss_count {0},
+  reject_count {0}
+{
+  size_t shard_bytes {std::max<size_t>(capacity_bytes / shard_count, 1024)};
+  // W-TinyLFU proportions: 1% window, 80% of the main segment protected
+  window_capacity = std::max<size_t>(shard_bytes / 100, 1);
+  main_capacity = shard_bytes - window_capacity;
+  protected_capacity = main_capacity * 4 / 5;
+  for (size_t i = 0; i < shard_count; ++i)
+    shards.push_back(unique_ptr<shard> {new shard {std::max<size_t>(shard_bytes / 256, 64)}});
+}
+
+/*
+  Azure Storage does not allow control characters in keys,
+  so the separators cannot occur inside a component, and
+  point and partition keys cannot collide.
+*/
+string EntityCache::make_key(const string& table,
+                             const string& partition,
+                             const string& row) {
+  string key {table};
+  key += '\x1f';
+  key += partition;
+  key += '\x1f';
+  key += row;
+  return key;
+}
+
+string EntityCache::make_partition_key(const string& table,
+                                       const string& partition) {
+  string key {table};
+  key += '\x1f';
+  key += partition;
+  key += '\x1e';
+  return key;
+}
+
+size_t EntityCache::entry_bytes(const string& key,
+                                const vector<table_entity>& entities,
+                                const vector<string>& tokens) {
+  size_t bytes {node_overhead + 2 * key.size()}; // The key is held by the node and the index
+  for (const auto& e : entities) {
+    bytes += entity_overhead + e.partition_key().size() + e.row_key().size() + e.etag().size();
+    for (const auto& p : e.properties()) {
+      bytes += property_overhead + p.first.size();
+      if (p.second.property_type() == edm_type::string)
+        bytes += p.second.string_value().size();
+      else if (p.second.property_type() == edm_type::binary)
+        bytes += p.second.binary_value().size();
+      else
+        bytes += sizeof(uint64_t);
+    }
+  }
+  for (const auto& t : tokens)
+    bytes += token_overhead + t.size();
+  return bytes;
+}
+
+size_t EntityCache::shard_index(const string& key) {
+  return std::hash<string> {} (key) % shard_count;
+}
+
+EntityCache::read_mark EntityCache::mark() const {
+  read_mark m;
+  for (size_t i = 0; i < shard_count; ++i)
+    m.generations[i] = shards[i]->generation.load(std::memory_order_acquire);
+  return m;
+}
+
+void EntityCache::erase(shard& s, lru_t::iterator n) {
+  s.bytes[n->seg] -= n->bytes;
+  s.index.erase(n->key);
+  s.lru[n->seg].erase(n);
+}
+
+/*
+  Move an entry that has just been used to the front of its segment.
+  An entry used while on probation is promoted to the protected
+  segment, demoting the least recently used protected entries if
+  that segment is over its budget.
+*/
+void EntityCache::touch(shard& s, lru_t::iterator n) {
+  if (n->seg != probation_seg) {
+    s.lru[n->seg].splice(s.lru[n->seg].begin(), s.lru[n->seg], n);
+    return;
+  }
+
+  s.bytes[probation_seg] -= n->bytes;
+  s.bytes[protected_seg] += n->bytes;
+  n->seg = protected_seg;
+  s.lru[protected_seg].splice(s.lru[protected_seg].begin(), s.lru[probation_seg], n);
+
+  lru_t& prot (s.lru[protected_seg]);
+  while (s.bytes[protected_seg] > protected_capacity && prot.size() > 1) {
+    lru_t::iterator demoted {std::prev(prot.end())};
+    s.bytes[protected_seg] -= demoted->bytes;
+    s.bytes[probation_seg] += demoted->bytes;
+    demoted->seg = probation_seg;
+    s.lru[probation_seg].splice(s.lru[probation_seg].begin(), prot, demoted);
+  }
+}
+
+/*
+  Move entries from the window to the main segment while the window is
+  over its budget. Each entry leaving the window is a candidate that
+  must be accessed more often than every entry evicted to make room for
+  it; otherwise the candidate itself is dropped. Then evict the least
+  recently used main entries, probation first, until the main segment
+  is within its budget.
+*/
+void EntityCache::evict(shard& s) {
+  lru_t& window (s.lru[window_seg]);
+  lru_t& probation (s.lru[probation_seg]);
+  lru_t& prot (s.lru[protected_seg]);
+
+  while (s.bytes[window_seg] > window_capacity && ! window.empty()) {
+    lru_t::iterator candidate {std::prev(window.end())};
+    s.bytes[window_seg] -= candidate->bytes;
+    s.bytes[probation_seg] += candidate->bytes;
+    candidate->seg = probation_seg;
+    probation.splice(probation.begin(), window, candidate);
+
+    unsigned candidate_freq {s.sketch.frequency(std::hash<string> {} (candidate->key))};
+    while (s.bytes[probation_seg] + s.bytes[protected_seg] > main_capacity) {
+      lru_t::iterator victim;
+      if (std::prev(probation.end()) != candidate)
+        victim = std::prev(probation.end());
+      else if ( ! prot.empty())
+        victim = std::prev(prot.end());
+      else
+        victim = candidate;
+
+      if (victim != candidate &&
+          candidate_freq > s.sketch.frequency(std::hash<string> {} (victim->key))) {
+        erase(s, victim);
+      }
+      else {
+        erase(s, candidate);
+        ++reject_count;
+        break;
+      }
+    }
+  }
+
+  // A stored entry that grew in place can put the main segment over its budget
+  while (s.bytes[probation_seg] + s.bytes[protected_seg] > main_capacity &&
+         ! (probation.empty() && prot.empty()))
+    erase(s, std::prev(probation.empty() ? prot.end() : probation.end()));
+}
+
+/*
+  Set n to the live entry for key and return true, removing
+  the entry if it has expired.
+*/
+bool EntityCache::find(shard& s, const string& key, lru_t::iterator& n) {
+  auto entry (s.index.find(key));
+  if (entry == s.index.end())
+    return false;
+  n = entry->second;
+  if (n->expires <= steady_clock::now()) {
+    erase(s, n);
+    return false;
+  }
+  return true;
+}
+
+void EntityCache::store(const string& key,
+                        bool missing,
+                        const vector<table_entity>& entities,
+                        const string& token,
+                        const read_mark& mark) {
+  const size_t i {shard_index(key)};
+  shard& s (*shards[i]);
+  scoped_critical_section_t lock {s.lock};
+  // The read may have begun before a write that has since invalidated this shard
+  if (s.generation.load(std::memory_order_relaxed) != mark.generations[i])
+    return;
+  s.sketch.increment(std::hash<string> {} (key));
+
+  steady_clock::time_point expires {steady_clock::now() + ttl};
+  lru_t::iterator n;
+  if (find(s, key, n)) {
+    /*
+      A fresh read of the same entity. It renews the entry's expiry,
+      so only the token it was read with, if any, stays trusted: a
+      token is never honoured for longer than ttl after storage last
+      accepted it.
+    */
+    n->tokens.clear();
+    if ( ! token.empty())
+      n->tokens.push_back(token);
+    n->missing = missing;
+    n->entities = entities;
+    n->expires = expires;
+    s.bytes[n->seg] -= n->bytes;
+    n->bytes = entry_bytes(key, n->entities, n->tokens);
+    s.bytes[n->seg] += n->bytes;
+    touch(s, n);
+    evict(s);
+    return;
+  }
+
+  vector<string> tokens {};
+  if ( ! token.empty())
+    tokens.push_back(token);
+  size_t bytes {entry_bytes(key, entities, tokens)};
+  if (bytes > window_capacity + main_capacity) {
+    ++reject_count;
+    return;
+  }
+
+  lru_t& window (s.lru[window_seg]);
+  window.push_front(node {key, missing, entities, tokens, expires, bytes, window_seg});
+  s.bytes[window_seg] += bytes;
+  s.index[key] = window.begin();
+  evict(s);
+}
+
+void EntityCache::remove(const string& key) {
+  shard& s (*shards[shard_index(key)]);
+  scoped_critical_section_t lock {s.lock};
+  // Even if key is not cached, a read in flight may be about to insert it
+  s.generation.fetch_add(1, std::memory_order_release);
+
+  auto entry (s.index.find(key));
+  if (entry != s.index.end())
+    erase(s, entry->second);
+}
+
+EntityCache::lookup_result EntityCache::lookup(const string& table,
+                                               const string& partition,
+                                               const string& row,
+                                               table_entity& entity) {
+  return lookup(table, partition, row, [&entity] (const table_entity& cached) { entity = cached; });
+}
+
+EntityCache::lookup_result EntityCache::lookup(const string& table,
+                                               const string& partition,
+                                               const string& row,
+                                               const std::function<void(const table_entity&)>& use) {
+  string key {make_key(table, partition, row)};
+  shard& s (*shards[shard_index(key)]);
+  scoped_critical_section_t lock {s.lock};
+  s.sketch.increment(std::hash<string> {} (key));
+
+  lru_t::iterator n;
+  if ( ! find(s, key, n)) {
+    ++miss_count;
+    return miss;
+  }
+
+  touch(s, n);
+  ++hit_count;
+  if (n->missing)
+    return not_found;
+  use(n->entities.front());
+  return hit;
+}
+
+bool EntityCache::lookup_with_token(const string& table,
+                                    const string& partition,
+                                    const string& row,
+                                    const string& token,
+                                    table_entity& entity) {
+  string key {make_key(table, partition, row)};
+  shard& s (*shards[shard_index(key)]);
+  scoped_critical_section_t lock {s.lock};
+  s.sketch.increment(std::hash<string> {} (key));
+
+  lru_t::iterator n;
+  if ( ! find(s, key, n) ||
+       n->missing ||
+       std::find(n->tokens.begin(), n->tokens.end(), token) == n->tokens.end()) {
+    ++miss_count;
+    return false;
+  }
+
+  touch(s, n);
+  ++hit_count;
+  entity = n->entities.front();
+  return true;
+}
+
+bool EntityCache::lookup_partition(const string& table,
+                                   const string& partition,
+                                   vector<table_entity>& entities) {
+  string key {make_partition_key(table, partition)};
+  shard& s (*shards[shard_index(key)]);
+  scoped_critical_section_t lock {s.lock};
+  s.sketch.increment(std::hash<string> {} (key));
+
+  lru_t::iterator n;
+  if ( ! find(s, key, n)) {
+    ++miss_count;
+    return false;
+  }
+
+  touch(s, n);
+  ++hit_count;
+  entities = n->entities;
+  return true;
+}
+
+void EntityCache::insert(const string& table,
+                         const table_entity& entity,
+                         const read_mark& mark,
+                         const string& token) {
+  store(make_key(table, entity.partition_key(), entity.row_key()),
+        false,
+        vector<table_entity> {entity},
+        token,
+        mark);
+}
+
+void EntityCache::insert_missing(const string& table,
+                                 const string& partition,
+                                 const string& row,
+                                 const read_mark& mark) {
+  store(make_key(table, partition, row),
+        true,
+        vector<table_entity> {table_entity {partition, row}},
+        string {},
+        mark);
+}
+
+void EntityCache::insert_partition(const string& table,
+                                   const string& partition,
+                                   const vector<table_entity>& entities,
+                                   const read_mark& mark) {
+  store(make_partition_key(table, partition), false, entities, string {}, mark);
+}
+
+void EntityCache::invalidate(const string& table,
+                             const string& partition,
+                             const string& row) {
+  remove(make_key(table, partition, row));
+  remove(make_partition_key(table, partition));
+}
+
+/*
+  Remove every entry of a table. This walks every shard, which
+  is acceptable for the table-wide writes that call it.
+*/
+void EntityCache::invalidate_table(const string& table) {
+  string prefix {table};
+  prefix += '\x1f';
+  for (auto& sp : shards) {
+    shard& s (*sp);
+    scoped_critical_section_t lock {s.lock};
+    s.generation.fetch_add(1, std::memory_order_release);
+    for (lru_t& l : s.lru) {
+      for (auto n = l.begin(); n != l.end(); ) {
+        auto next (std::next(n));
+        if (n->key.compare(0, prefix.size(), prefix) == 0)
+          erase(s, n);
+        n = next;
+      }
+    }
+  }
+}
+
+size_t EntityCache::bytes() {
+  size_t total {0};
+  for (auto& sp : shards) {
+    scoped_critical_section_t lock {sp->lock};
+    for (size_t b : sp->bytes)
+      total += b;
+  }
+  return total;
+}
@@ -0,0 +1,238 @@
+#ifndef EntityCache_h
+#define EntityCache_h
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/table.h>
+
+/*
+  Approximate access counts of keys, as a count-min sketch of
+  counters saturating at 15. All counters are halved once the number
+  of recorded accesses reaches ten times the width, so the
+  counts favour recent popularity.
+*/
+class FrequencySketch {
+private:
+  static constexpr unsigned depth {4};
+
+  std::vector<std::uint8_t> counters; // depth rows of width counters
+  std::size_t width; // A power of 2
+  std::size_t additions;
+  std::size_t sample_size;
+
+  std::size_t index(std::size_t hash, unsigned row) const;
+public:
+  FrequencySketch (std::size_t expected_keys);
+
+  void increment(std::size_t hash);
+  unsigned frequency(std::size_t hash) const;
+};
+
+/*
+  Bounded read-through cache of table entities and partition
+  query results.
+
+  Point entries are keyed by (table, partition, row); partition
+  entries hold every entity of a partition as returned by a
+  ReadEntityAdmin partition query.
+
+  The cache is bounded by the estimated bytes of its entries, not
+  their number, as property values range from a few bytes to tens of
+  kilobytes. It is split into shards, each with its own lock and byte
+  budget, so concurrent requests for different keys rarely contend.
+
+  Each shard uses the W-TinyLFU policy: new entries enter a small LRU
+  window. An entry leaving the window is only admitted to the main
+  segmented LRU if it has been accessed more often than the entries it
+  would evict, judged by a FrequencySketch of recent accesses. A scan
+  that touches every entity once therefore cannot flush the entries
+  that are read repeatedly.
+
+  Callers must invalidate an entity after writing it and a table after
+  any table-wide write. Invalidating an entity also invalidates its
+  partition entry. A read from storage that began before a concurrent
+  write could finish after that write's invalidation, so callers take
+  a read_mark before each storage read and pass it to the insert of
+  what was read. The insert is dropped if the entry's shard has been
+  invalidated since the mark. Entries expire after ttl, which bounds
+  how long an entity changed by a client outside this server can be
+  served.
+
+  Entities read with a security token also record the token. A token
+  read is only answered from the cache if the same token was accepted
+  by Azure Storage when the entry was last read. Each read replaces the
+  recorded token, so one that has expired or been revoked is trusted for
+  at most ttl, however often the entity is read in other ways.
+
+  The cache also holds negative entries for keys that storage reported
+  missing, so repeated reads of a missing entity do not reach storage.
+  Writing the key invalidates its negative entry like any other.
+*/
+class EntityCache {
+public:
+  enum lookup_result { miss, hit, not_found };
+private:
+  static constexpr std::size_t shard_count {16};
+public:
+  /*
+    The generation of every shard when a storage read began. Invalidations
+    are counted per shard, so an invalidation of any key in the same shard
+    also drops the insert; that costs a miss, never a stale entry.
+  */
+  class read_mark {
+    friend class EntityCache;
+    std::array<std::uint64_t,shard_count> generations;
+  };
+private:
+
+  enum segment { window_seg, probation_seg, protected_seg };
+
+  struct node {
+    std::string key;
+    bool missing; // A negative entry
+    std::vector<azure::storage::table_entity> entities; // One for a point entry
+    std::vector<std::string> tokens; // The token the entity was last read with, if any
+    std::chrono::steady_clock::time_point expires;
+    std::size_t bytes;
+    segment seg;
+  };
+
+  using lru_t = std::list<node>;
+
+  struct shard {
+    pplx::extensibility::critical_section_t lock;
+    std::array<lru_t,3> lru; // Indexed by segment, most recently used first
+    std::array<std::size_t,3> bytes; // Indexed by segment
+    std::unordered_map<std::string,lru_t::iterator> index;
+    FrequencySketch sketch;
+    std::atomic<std::uint64_t> generation; // Invalidations so far; only changed under lock
+
+    shard (std::size_t expected_keys);
+  };
+
+  std::vector<std::unique_ptr<shard>> shards;
+  std::size_t window_capacity; // Bytes per shard
+  std::size_t main_capacity; // Bytes per shard
+  std::size_t protected_capacity; // Bytes per shard
+  std::chrono::steady_clock::duration ttl;
+  std::atomic<unsigned long> hit_count;
+  std::atomic<unsigned long> miss_count;
+  std::atomic<unsigned long> reject_count;
+
+  static std::string make_key(const std::string& table,
+                              const std::string& partition,
+                              const std::string& row);
+  static std::string make_partition_key(const std::string& table,
+                                        const std::string& partition);
+  static std::size_t shard_index(const std::string& key);
+  static std::size_t entry_bytes(const std::string& key,
+                                 const std::vector<azure::storage::table_entity>& entities,
+                                 const std::vector<std::string>& tokens);
+  void erase(shard& s, lru_t::iterator n);
+  void touch(shard& s, lru_t::iterator n);
+  void evict(shard& s);
+  bool find(shard& s, const std::string& key, lru_t::iterator& n);
+  void store(const std::string& key,
+             bool missing,
+             const std::vector<azure::storage::table_entity>& entities,
+             const std::string& token,
+             const read_mark& mark);
+  void remove(const std::string& key);
+public:
+  EntityCache (std::size_t capacity_bytes = 64 * 1024 * 1024,
+               std::chrono::steady_clock::duration entry_ttl = std::chrono::seconds {60});
+
+  EntityCache (const EntityCache&) = delete;
+  EntityCache& operator= (const EntityCache&) = delete;
+
+  // Take before a storage read whose result will be inserted
+  read_mark mark() const;
+
+  /*
+    If the entity is cached, copy it to entity and return hit.
+    Return not_found if the entity is known not to exist.
+  */
+  lookup_result lookup(const std::string& table,
+                       const std::string& partition,
+                       const std::string& row,
+                       azure::storage::table_entity& entity);
+
+  /*
+    As above, but instead of copying a cached entity, call use with it
+    while the cache's lock is held. use must be quick and must not
+    call the cache.
+  */
+  lookup_result lookup(const std::string& table,
+                       const std::string& partition,
+                       const std::string& row,
+                       const std::function<void(const azure::storage::table_entity&)>& use);
+
+  /*
+    Return true and copy the entity if it is cached and token was
+    accepted for it. Negative entries are never used for token reads.
+  */
+  bool lookup_with_token(const std::string& table,
+                         const std::string& partition,
+                         const std::string& row,
+                         const std::string& token,
+                         azure::storage::table_entity& entity);
+
+  /*
+    If the entities of a partition are cached, copy them to
+    entities and return true.
+  */
+  bool lookup_partition(const std::string& table,
+                        const std::string& partition,
+                        std::vector<azure::storage::table_entity>& entities);
+
+  /*
+    Cache an entity just read from table by a read that began at mark.
+    If token is not empty, the entity was read with that token.
+  */
+  void insert(const std::string& table,
+              const azure::storage::table_entity& entity,
+              const read_mark& mark,
+              const std::string& token = std::string {});
+
+  /*
+    Record that an entity does not exist
+  */
+  void insert_missing(const std::string& table,
+                      const std::string& partition,
+                      const std::string& row,
+                      const read_mark& mark);
+
+  /*
+    Cache every entity of a partition just read from table
+  */
+  void insert_partition(const std::string& table,
+                        const std::string& partition,
+                        const std::vector<azure::storage::table_entity>& entities,
+                        const read_mark& mark);
+
+  void invalidate(const std::string& table,
+                  const std::string& partition,
+                  const std::string& row);
+  void invalidate_table(const std::string& table);
+
+  unsigned long hits() const { return hit_count.load(); }
+  unsigned long misses() const { return miss_count.load(); }
+  // Entries the admission policy refused to keep
+  unsigned long rejections() const { return reject_count.load(); }
+  // Estimated bytes currently cached
+  std::size_t bytes();
+};
+
+#endif
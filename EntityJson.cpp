@@ -0,0 +1,151 @@
+/*
+  Direct serialization of table entities to JSON
+ */
+
+#include "EntityJson.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <was/table.h>
+
+using azure::storage::edm_type;
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+
+using std::string;
+using std::vector;
+
+namespace {
+  void append_integer (string& out, std::int64_t n) {
+    char digits[24];
+    char* end {digits + sizeof digits};
+    char* p {end};
+    // The magnitude of the most negative value only fits unsigned
+    std::uint64_t magnitude {n < 0 ? 0 - static_cast<std::uint64_t>(n) : static_cast<std::uint64_t>(n)};
+    do {
+      *--p = static_cast<char>('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude != 0);
+    if (n < 0)
+      *--p = '-';
+    out.append(p, end - p);
+  }
+
+  void append_double (string& out, double d) {
+    if ( ! std::isfinite(d)) {
+      out += "null";
+      return;
+    }
+    // The precision json::value uses, enough to read back the same double
+    char text[32];
+    const int length {std::snprintf(text, sizeof text, "%.*g", std::numeric_limits<double>::digits10 + 2, d)};
+    out.append(text, length);
+  }
+
+  void append_member_name (string& out, const string& name, std::size_t& members) {
+    if (members++ > 0)
+      out += ',';
+    append_json_string(out, name);
+    out += ':';
+  }
+}
+
+void append_json_string(string& out, const string& s) {
+  static constexpr const char* hex {"0123456789abcdef"};
+  out += '"';
+  std::size_t run {0}; // Start of the characters not yet appended
+  for (std::size_t i = 0; i < s.size(); ++i) {
+    const unsigned char c {static_cast<unsigned char>(s[i])};
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    out.append(s, run, i - run);
+    run = i + 1;
+    switch (c) {
+    case '"':  out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\b': out += "\\b"; break;
+    case '\f': out += "\\f"; break;
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    default:
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xf];
+    }
+  }
+  out.append(s, run, string::npos);
+  out += '"';
+}
+
+void append_property_json(string& out, const entity_property& property) {
+  if (property.is_null()) {
+    out += "null";
+    return;
+  }
+  switch (property.property_type()) {
+  case edm_type::string:
+    append_json_string(out, property.string_value());
+    break;
+  case edm_type::int32:
+    append_integer(out, property.int32_value());
+    break;
+  case edm_type::int64:
+    append_integer(out, property.int64_value());
+    break;
+  case edm_type::double_floating_point:
+    append_double(out, property.double_value());
+    break;
+  case edm_type::boolean:
+    out += property.boolean_value() ? "true" : "false";
+    break;
+  default: // datetime, guid and binary
+    append_json_string(out, property.str());
+  }
+}
+
+std::size_t append_entity_json(string& out, const table_entity& entity, bool with_keys,
+                               const vector<string>& columns) {
+  std::size_t members {0};
+  out += '{';
+  if (with_keys) {
+    out += "\"Partition\":";
+    append_json_string(out, entity.partition_key());
+    out += ",\"Row\":";
+    append_json_string(out, entity.row_key());
+    members = 2;
+  }
+
+  const table_entity::properties_type& properties (entity.properties());
+  if (columns.empty()) {
+    for (const auto& p : properties) {
+      append_member_name(out, p.first, members);
+      append_property_json(out, p.second);
+    }
+  }
+  else {
+    for (const auto& c : columns) {
+      auto p (properties.find(c));
+      if (p == properties.end() || p->second.is_null())
+        continue;
+      append_member_name(out, p->first, members);
+      append_property_json(out, p->second);
+    }
+  }
+  out += '}';
+  return members;
+}
+
+string& json_buffer() {
+  thread_local string buffer {};
+  if (buffer.capacity() > max_reused_bytes)
+    string {}.swap(buffer);
+  buffer.clear();
+  return buffer;
+}
@@ -0,0 +1,56 @@
+#ifndef EntityJson_h
+#define EntityJson_h
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <was/table.h>
+
+/*
+  Serializes table entities to JSON text directly, without building
+  a web::json::value tree and serializing that.
+
+  Each function appends to a string that the caller reuses, so once
+  the string has grown to the size of its largest body, serializing
+  an entity allocates nothing, apart from any allocation the storage
+  library makes to give the text of a datetime, guid or binary
+  property.
+
+  Property types map to JSON as follows:
+    string, datetime (ISO 8601), guid, binary (base64)  string
+    int32, int64, double                                number
+    boolean                                             true or false
+  A double that is not finite, which JSON cannot express, and a
+  null property are written as null.
+*/
+
+// Append s as a quoted JSON string, escaping as RFC 7159 requires
+void append_json_string(std::string& out, const std::string& s);
+
+void append_property_json(std::string& out, const azure::storage::entity_property& property);
+
+/*
+  Append entity as a JSON object. If with_keys is true, its first
+  members are "Partition" and "Row". If columns is not empty, only
+  the properties it names follow, in the order given, skipping names
+  the entity lacks or has null; otherwise all properties do.
+
+  Returns the number of members written.
+*/
+std::size_t append_entity_json(std::string& out,
+                               const azure::storage::table_entity& entity,
+                               bool with_keys,
+                               const std::vector<std::string>& columns = std::vector<std::string> {});
+
+/*
+  Return this thread's string for building a response body, emptied.
+  Its capacity is kept between bodies, unless a body made it larger
+  than max_reused_bytes, so the next body usually needs no allocation.
+  The string is only valid until the next call on the same thread.
+*/
+constexpr std::size_t max_reused_bytes {1024 * 1024};
+
+std::string& json_buffer();
+
+#endif
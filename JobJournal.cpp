@@ -0,0 +1,165 @@
+/*
+  Checkpoint journal of table-wide jobs
+ */
+
+#include "JobJournal.h"
+
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cpprest/json.h>
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::size_t;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+using web::json::value;
+
+using fields_t = vector<pair<string,value>>;
+
+static const string start_event {"Start"};
+static const string checkpoint_event {"Checkpoint"};
+static const string end_event {"End"};
+
+JobJournal::JobJournal (const string& file_name) :
+  file_name {file_name}, out {}, lock {}
+{}
+
+void JobJournal::append(const string& line) {
+  scoped_critical_section_t l {lock};
+  if ( ! out.is_open())
+    return;
+  out << line << '\n';
+  out.flush();
+}
+
+static value properties_value (const unordered_map<string,string>& properties) {
+  fields_t fields;
+  for (const auto& p : properties)
+    fields.push_back(make_pair(p.first, value::string(p.second)));
+  return value::object(fields);
+}
+
+vector<JobJournal::unfinished_job> JobJournal::recover() {
+  vector<unfinished_job> jobs;
+  unordered_map<string,size_t> index; // Job id -> position in jobs
+  vector<bool> ended;
+
+  std::ifstream in {file_name};
+  string line;
+  while (getline(in, line)) {
+    value record;
+    try {
+      record = value::parse(line);
+      const string event {record.at("Event").as_string()};
+      const string id {record.at("JobId").as_string()};
+      if (event == start_event) {
+        unfinished_job job {id, record.at("Operation").as_string(), record.at("Table").as_string(), {}, string {}, string {}, string {}, 0};
+        for (const auto& p : record.at("Properties").as_object())
+          job.properties[p.first] = p.second.as_string();
+        index[id] = jobs.size();
+        jobs.push_back(job);
+        ended.push_back(false);
+        continue;
+      }
+      auto j (index.find(id));
+      if (j == index.end())
+        continue;
+      if (event == checkpoint_event) {
+        jobs[j->second].token = record.at("Token").as_string();
+        jobs[j->second].partition = record.at("Partition").as_string();
+        jobs[j->second].row = record.at("Row").as_string();
+        jobs[j->second].scanned = static_cast<size_t>(record.at("Scanned").as_number().to_uint64());
+      }
+      else if (event == end_event) {
+        ended[j->second] = true;
+      }
+    }
+    catch (const std::exception& e) {
+      cout << "Ignoring journal line \"" << line << "\": " << e.what() << endl;
+    }
+  }
+  in.close();
+
+  vector<unfinished_job> unfinished;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if ( ! ended[i])
+      unfinished.push_back(jobs[i]);
+  }
+
+  // Compact: keep only what resuming needs, replacing the file atomically
+  const string compacted {file_name + ".new"};
+  {
+    std::ofstream tmp {compacted, std::ios::trunc};
+    for (const auto& job : unfinished) {
+      tmp << value::object(fields_t {
+          make_pair("Event", value::string(start_event)),
+          make_pair("JobId", value::string(job.id)),
+          make_pair("Operation", value::string(job.operation)),
+          make_pair("Table", value::string(job.table)),
+          make_pair("Properties", properties_value(job.properties))}).serialize() << '\n';
+      if ( ! job.token.empty() || job.scanned > 0)
+        tmp << value::object(fields_t {
+            make_pair("Event", value::string(checkpoint_event)),
+            make_pair("JobId", value::string(job.id)),
+            make_pair("Token", value::string(job.token)),
+            make_pair("Partition", value::string(job.partition)),
+            make_pair("Row", value::string(job.row)),
+            make_pair("Scanned", value::number(static_cast<uint64_t>(job.scanned)))}).serialize() << '\n';
+    }
+  }
+  if (std::rename(compacted.c_str(), file_name.c_str()) != 0)
+    cout << "Cannot replace journal " << file_name << endl;
+
+  scoped_critical_section_t l {lock};
+  out.open(file_name, std::ios::app);
+  if ( ! out)
+    cout << "Cannot open journal " << file_name << "; jobs will not be resumable" << endl;
+  return unfinished;
+}
+
+void JobJournal::record_start(const string& id,
+                              const string& operation,
+                              const string& table,
+                              const unordered_map<string,string>& properties) {
+  append(value::object(fields_t {
+        make_pair("Event", value::string(start_event)),
+        make_pair("JobId", value::string(id)),
+        make_pair("Operation", value::string(operation)),
+        make_pair("Table", value::string(table)),
+        make_pair("Properties", properties_value(properties))}).serialize());
+}
+
+void JobJournal::record_checkpoint(const string& id,
+                                   const string& token,
+                                   const string& partition,
+                                   const string& row,
+                                   size_t scanned) {
+  append(value::object(fields_t {
+        make_pair("Event", value::string(checkpoint_event)),
+        make_pair("JobId", value::string(id)),
+        make_pair("Token", value::string(token)),
+        make_pair("Partition", value::string(partition)),
+        make_pair("Row", value::string(row)),
+        make_pair("Scanned", value::number(static_cast<uint64_t>(scanned)))}).serialize());
+}
+
+void JobJournal::record_end(const string& id, const string& state) {
+  append(value::object(fields_t {
+        make_pair("Event", value::string(end_event)),
+        make_pair("JobId", value::string(id)),
+        make_pair("State", value::string(state))}).serialize());
+}
@@ -0,0 +1,75 @@
+#ifndef JobJournal_h
+#define JobJournal_h
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  Append-only file recording the progress of table-wide jobs, so
+  that jobs interrupted by a restart of the server can be resumed
+  where they stopped instead of from the start of the table.
+
+  Each line is a JSON object with an "Event" of:
+
+    Start       JobId, Operation, Table and the job's Properties
+    Checkpoint  JobId, Token: continuation token of the next segment,
+                Partition and Row: last key written, Scanned: entities so far
+    End         JobId, State
+
+  A job is written to the journal before it is queued, and a
+  checkpoint only once every entity before it has been written,
+  so resuming from the last checkpoint may repeat writes but never
+  skips any. Lines are flushed to the operating system as they are
+  written; a line cut short by a crash is ignored on reading.
+*/
+class JobJournal {
+public:
+  /*
+    A job with a Start but no End, as of its last checkpoint
+  */
+  struct unfinished_job {
+    std::string id;
+    std::string operation;
+    std::string table;
+    std::unordered_map<std::string,std::string> properties;
+    std::string token; // Empty to start from the beginning of the table
+    std::string partition; // Last key written, for the log
+    std::string row;
+    std::size_t scanned;
+  };
+private:
+  std::string file_name;
+  std::ofstream out;
+  pplx::extensibility::critical_section_t lock;
+
+  void append(const std::string& line);
+public:
+  JobJournal (const std::string& file_name);
+
+  JobJournal (const JobJournal&) = delete;
+  JobJournal& operator= (const JobJournal&) = delete;
+
+  /*
+    Read the journal, rewrite it to hold only the unfinished
+    jobs and open it for appending. Return the unfinished jobs.
+  */
+  std::vector<unfinished_job> recover();
+
+  void record_start(const std::string& id,
+                    const std::string& operation,
+                    const std::string& table,
+                    const std::unordered_map<std::string,std::string>& properties);
+  void record_checkpoint(const std::string& id,
+                         const std::string& token,
+                         const std::string& partition,
+                         const std::string& row,
+                         std::size_t scanned);
+  void record_end(const std::string& id, const std::string& state);
+};
+
+#endif
@@ -0,0 +1,177 @@
+/*
+  Background jobs for long administrative operations
+ */
+
+#include "JobManager.h"
+
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+using std::cout;
+using std::endl;
+using std::shared_ptr;
+using std::string;
+
+using std::chrono::steady_clock;
+
+using guard_t = std::unique_lock<std::mutex>;
+
+JobManager::Job::Job (const string& id, const string& operation, const string& table) :
+  id {id}, operation {operation}, table {table}, current {state::queued},
+  cancel_requested {false}, stop_requested {false}, processed {0}, total {0}
+{}
+
+JobManager::JobManager (std::size_t worker_count, std::size_t retained_jobs) :
+  lock {}, ready {}, queue {}, jobs {}, finished_ids {}, workers {},
+  retained {retained_jobs}, next_id {0}, stopping {false}
+{
+  for (std::size_t i = 0; i < worker_count; ++i)
+    workers.push_back(std::thread {[this] () { run(); }});
+}
+
+JobManager::~JobManager () {
+  stop();
+}
+
+string JobManager::state_name(state s) {
+  switch (s) {
+  case state::queued: return "Queued";
+  case state::running: return "Running";
+  case state::succeeded: return "Succeeded";
+  case state::failed: return "Failed";
+  case state::cancelled: return "Cancelled";
+  }
+  return "Unknown";
+}
+
+/*
+  Ids stay unique across restarts of the server
+*/
+string JobManager::make_id() {
+  auto now (std::chrono::system_clock::now().time_since_epoch());
+  return std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(now).count())
+    + "-" + std::to_string(++next_id);
+}
+
+string JobManager::new_id() {
+  guard_t l {lock};
+  return make_id();
+}
+
+string JobManager::submit(const string& operation, const string& table, work_t work, const string& id) {
+  guard_t l {lock};
+  shared_ptr<Job> job {std::make_shared<Job>(id.empty() ? make_id() : id, operation, table)};
+  jobs[job->id] = job;
+  queue.push_back(entry {job, std::move(work)});
+  ready.notify_one();
+  return job->id;
+}
+
+void JobManager::run() {
+  for (;;) {
+    entry e {};
+    {
+      guard_t l {lock};
+      ready.wait(l, [this] () { return stopping || ! queue.empty(); });
+      if (queue.empty())
+        return;
+      e = std::move(queue.front());
+      queue.pop_front();
+    }
+
+    Job& job (*e.job);
+    job.started = steady_clock::now();
+    state result {state::succeeded};
+    string error {};
+    if (job.cancelled()) {
+      result = state::cancelled;
+    }
+    else {
+      job.current.store(state::running);
+      cout << "Job " << job.id << ": " << job.operation << " " << job.table << " started" << endl;
+      try {
+        e.work(job);
+        if (job.cancelled())
+          result = state::cancelled;
+      }
+      catch (const std::exception& ex) {
+        result = state::failed;
+        error = ex.what();
+      }
+    }
+
+    guard_t l {lock};
+    job.finished = steady_clock::now();
+    job.error = error;
+    job.current.store(result);
+    cout << "Job " << job.id << ": " << state_name(result) << " after "
+         << job.processed.load() << " entities" << endl;
+    finished_ids.push_back(job.id);
+    while (finished_ids.size() > retained) {
+      jobs.erase(finished_ids.front());
+      finished_ids.pop_front();
+    }
+  }
+}
+
+bool JobManager::get_status(const string& id, status& s) {
+  guard_t l {lock};
+  auto j (jobs.find(id));
+  if (j == jobs.end())
+    return false;
+  const Job& job (*j->second);
+  s.id = job.id;
+  s.operation = job.operation;
+  s.table = job.table;
+  state current {job.current.load()};
+  s.state = state_name(current);
+  s.error = job.error;
+  s.processed = job.processed.load();
+  s.total = job.total.load();
+  s.elapsed_seconds = 0;
+  s.rate = 0;
+  s.eta_seconds = -1;
+  if (current == state::queued)
+    return true;
+
+  auto end (current == state::running ? steady_clock::now() : job.finished);
+  s.elapsed_seconds = std::chrono::duration<double> {end - job.started}.count();
+  if (s.elapsed_seconds > 0)
+    s.rate = s.processed / s.elapsed_seconds;
+  if (current != state::running)
+    s.eta_seconds = 0;
+  else if (s.total > 0 && s.rate > 0)
+    s.eta_seconds = s.total > s.processed ? (s.total - s.processed) / s.rate : 0;
+  return true;
+}
+
+bool JobManager::cancel(const string& id) {
+  guard_t l {lock};
+  auto j (jobs.find(id));
+  if (j == jobs.end())
+    return false;
+  j->second->cancel_requested.store(true);
+  return true;
+}
+
+void JobManager::stop() {
+  {
+    guard_t l {lock};
+    if (stopping)
+      return;
+    stopping = true;
+    for (auto& j : jobs) {
+      j.second->stop_requested.store(true);
+      j.second->cancel_requested.store(true);
+    }
+    ready.notify_all();
+  }
+  for (auto& w : workers)
+    w.join();
+}
@@ -0,0 +1,136 @@
+#ifndef JobManager_h
+#define JobManager_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+  Runs long administrative operations in the background on its own
+  worker threads, so the request that starts one can be answered
+  at once with the id of the job.
+
+  A job's progress can be read while it runs and it can be cancelled.
+  Cancellation is cooperative: the work function must check
+  cancelled() regularly and return early when it is set. Finished
+  jobs are remembered until retained newer ones have finished.
+*/
+class JobManager {
+public:
+  enum class state { queued, running, succeeded, failed, cancelled };
+
+  /*
+    A job as seen by its work function
+  */
+  class Job {
+    friend class JobManager;
+  private:
+    std::string id;
+    std::string operation;
+    std::string table;
+    std::atomic<state> current;
+    std::atomic<bool> cancel_requested;
+    std::atomic<bool> stop_requested; // Cancelled because the server is stopping
+    std::atomic<std::size_t> processed;
+    std::atomic<std::size_t> total; // 0 if not known
+    std::chrono::steady_clock::time_point started {};
+    std::chrono::steady_clock::time_point finished {};
+    std::string error {};
+  public:
+    Job (const std::string& id, const std::string& operation, const std::string& table);
+
+    const std::string& job_id() const { return id; }
+    bool cancelled() const { return cancel_requested.load(); }
+    // True if cancelled by stop() rather than by a client
+    bool stopping() const { return stop_requested.load(); }
+    void set_processed(std::size_t n) { processed.store(n); }
+    void set_total(std::size_t n) { total.store(n); }
+  };
+
+  using work_t = std::function<void(Job&)>;
+
+  /*
+    A copy of a job's progress. rate is in entities per second;
+    eta_seconds is negative when it cannot be estimated.
+  */
+  struct status {
+    std::string id;
+    std::string operation;
+    std::string table;
+    std::string state;
+    std::string error;
+    std::size_t processed;
+    std::size_t total;
+    double elapsed_seconds;
+    double rate;
+    double eta_seconds;
+  };
+private:
+  struct entry {
+    std::shared_ptr<Job> job;
+    work_t work;
+  };
+
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<entry> queue;
+  std::unordered_map<std::string,std::shared_ptr<Job>> jobs;
+  std::deque<std::string> finished_ids; // Oldest first
+  std::vector<std::thread> workers;
+  std::size_t retained;
+  unsigned long next_id;
+  bool stopping;
+
+  void run();
+  std::string make_id();
+public:
+  JobManager (std::size_t worker_count = 1, std::size_t retained_jobs = 100);
+  ~JobManager ();
+
+  JobManager (const JobManager&) = delete;
+  JobManager& operator= (const JobManager&) = delete;
+
+  /*
+    Return an id for a job not yet submitted
+  */
+  std::string new_id();
+
+  /*
+    Queue work to run as a job and return its id, which is
+    id if that is not empty
+  */
+  std::string submit(const std::string& operation,
+                     const std::string& table,
+                     work_t work,
+                     const std::string& id = std::string {});
+
+  /*
+    Copy the progress of the job to s. Return false
+    if the job is unknown.
+  */
+  bool get_status(const std::string& id, status& s);
+
+  /*
+    Ask a queued or running job to stop. Return false
+    if the job is unknown.
+  */
+  bool cancel(const std::string& id);
+
+  /*
+    Cancel every job and wait for the workers to finish
+  */
+  void stop();
+
+  static std::string state_name(state s);
+};
+
+#endif
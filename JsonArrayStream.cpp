@@ -0,0 +1,300 @@
+/*
+  Chunked JSON array responses
+ */
+
+#include "JsonArrayStream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <ios>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+#include <cpprest/producerconsumerstream.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "Compression.h"
+#include "make_unique.h"
+
+using std::cout;
+using std::endl;
+using std::pair;
+using std::string;
+using std::vector;
+
+using web::http::header_names;
+using web::http::http_request;
+using web::http::http_response;
+using web::http::status_code;
+using web::http::status_codes;
+
+using web::json::value;
+
+using stream_clock = std::chrono::steady_clock;
+
+namespace {
+  using stream_buffer = concurrency::streams::producer_consumer_buffer<std::uint8_t>;
+
+  /*
+    Completes the drained() tasks of full buffers. A
+    producer_consumer_buffer gives no notice when its reader takes
+    bytes, so one thread checks the waiting buffers, and sleeps while
+    none is waiting. It checks again after min_poll while readers are
+    taking bytes or a buffer has just started waiting, and otherwise
+    doubles the interval up to max_poll, so clients that have stopped
+    reading cost little. The threads running requests never wait for
+    a client.
+  */
+  class DrainWatcher {
+  private:
+    struct waiter {
+      stream_buffer buffer; // Shares the stream's buffer
+      std::size_t limit;
+      stream_clock::duration timeout;
+      std::size_t pending;
+      stream_clock::time_point progress; // When the reader last took bytes
+      pplx::task_completion_event<bool> done;
+    };
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<waiter> waiters;
+    bool added; // A waiter has arrived since the last check
+    bool stopping;
+    std::thread checker;
+
+    void run();
+  public:
+    DrainWatcher ();
+    ~DrainWatcher ();
+
+    pplx::task<bool> wait(const stream_buffer& buffer, std::size_t limit, stream_clock::duration timeout);
+  };
+
+  DrainWatcher::DrainWatcher () :
+    lock {}, changed {}, waiters {}, added {false}, stopping {false}, checker {}
+  {
+    checker = std::thread {&DrainWatcher::run, this};
+  }
+
+  DrainWatcher::~DrainWatcher () {
+    {
+      std::lock_guard<std::mutex> l {lock};
+      stopping = true;
+    }
+    changed.notify_one();
+    checker.join();
+  }
+
+  pplx::task<bool> DrainWatcher::wait(const stream_buffer& buffer, std::size_t limit, stream_clock::duration timeout) {
+    pplx::task_completion_event<bool> done;
+    {
+      std::lock_guard<std::mutex> l {lock};
+      if (stopping)
+        return pplx::task_from_result(false);
+      waiters.push_back(waiter {buffer, limit, timeout, buffer.in_avail(), stream_clock::now(), done});
+      added = true;
+    }
+    changed.notify_one();
+    return pplx::create_task(done);
+  }
+
+  void DrainWatcher::run() {
+    constexpr stream_clock::duration min_poll {std::chrono::milliseconds {1}};
+    constexpr stream_clock::duration max_poll {std::chrono::milliseconds {32}};
+    stream_clock::duration poll {min_poll};
+    vector<pair<pplx::task_completion_event<bool>,bool>> finished;
+    std::unique_lock<std::mutex> l {lock};
+    while ( ! stopping) {
+      if (waiters.empty()) {
+        changed.wait(l);
+        continue;
+      }
+      bool moved {added};
+      added = false;
+      const stream_clock::time_point now {stream_clock::now()};
+      for (auto w = waiters.begin(); w != waiters.end(); ) {
+        const std::size_t pending {w->buffer.in_avail()};
+        if (pending < w->pending) {
+          w->progress = now;
+          moved = true;
+        }
+        w->pending = pending;
+        if (pending < w->limit)
+          finished.push_back(std::make_pair(w->done, true));
+        else if ( ! w->buffer.can_write() || now - w->progress > w->timeout)
+          finished.push_back(std::make_pair(w->done, false));
+        else {
+          ++w;
+          continue;
+        }
+        w = waiters.erase(w);
+      }
+      // Continuations may start streaming again at once, so run them unlocked
+      l.unlock();
+      for (auto& f : finished)
+        f.first.set(f.second);
+      finished.clear();
+      l.lock();
+      poll = moved ? min_poll : std::min(poll * 2, max_poll);
+      if ( ! stopping && ! added)
+        changed.wait_for(l, poll);
+    }
+    for (auto& w : waiters)
+      w.done.set(false);
+    waiters.clear();
+  }
+
+  DrainWatcher& drain_watcher () {
+    static DrainWatcher watcher {};
+    return watcher;
+  }
+}
+
+JsonArrayStream::JsonArrayStream (std::size_t limit, stream_clock::duration timeout) :
+  buffer {}, buffer_limit {limit}, stall_timeout {timeout}, empty {true}, failed {false},
+  message {}, code {status_codes::OK}, coding {content_coding::identity}, replied {false},
+  held {}, deflater {}, element_text {}
+{}
+
+void JsonArrayStream::reply(const http_request& request, status_code status) {
+  message = request;
+  code = status;
+  coding = negotiate_coding(message.headers());
+  // An uncompressed body can start at once
+  if (coding == content_coding::identity)
+    start();
+  write("[");
+}
+
+/*
+  Send the status and headers, then whatever of the body was held
+*/
+void JsonArrayStream::start() {
+  http_response response {code};
+  response.headers().add(header_names::vary, header_names::accept_encoding);
+  if (coding != content_coding::identity) {
+    deflater = std::make_unique<Deflater>(coding);
+    response.headers().add(header_names::content_encoding, coding_name(coding));
+  }
+  // No content length, so the body is sent with chunked transfer encoding
+  response.set_body(buffer.create_istream(), "application/json");
+  message.reply(response);
+  replied = true;
+
+  string start_of_body {};
+  std::swap(start_of_body, held);
+  if ( ! start_of_body.empty())
+    write(start_of_body);
+}
+
+/*
+  Append bytes to the body, holding them while its coding is undecided
+  and compressing them if it is compressed
+*/
+bool JsonArrayStream::write(const string& bytes) {
+  if (failed)
+    return false;
+  if ( ! replied) {
+    held += bytes;
+    if (held.size() >= compression_threshold)
+      start();
+    return ! failed;
+  }
+  if ( ! deflater)
+    return send(bytes);
+  try {
+    const string packed {deflater->compress(bytes)};
+    return packed.empty() || send(packed);
+  }
+  catch (const std::runtime_error& e) {
+    cout << "Compressing a streamed response failed: " << e.what() << endl;
+    failed = true;
+    return false;
+  }
+}
+
+/*
+  Put bytes in the buffer. The caller limits how far it runs ahead
+  of the client with drained().
+*/
+bool JsonArrayStream::send(const string& bytes) {
+  if (failed)
+    return false;
+  try {
+    buffer.putn_nocopy(reinterpret_cast<const std::uint8_t*>(bytes.data()), bytes.size()).wait();
+  }
+  catch (const std::exception& e) {
+    cout << "Streamed response failed: " << e.what() << endl;
+    failed = true;
+  }
+  return ! failed;
+}
+
+bool JsonArrayStream::add(const value& element) {
+  return add_json(element.serialize());
+}
+
+bool JsonArrayStream::add_json(const string& element) {
+  element_text.clear();
+  if ( ! empty)
+    element_text += ',';
+  element_text += element;
+  empty = false;
+  return write(element_text);
+}
+
+pplx::task<bool> JsonArrayStream::drained() {
+  if (failed)
+    return pplx::task_from_result(false);
+  // Held bytes are bounded by compression_threshold, and not yet in the buffer
+  if ( ! replied || buffer.in_avail() < buffer_limit)
+    return pplx::task_from_result(true);
+  return drain_watcher().wait(buffer, buffer_limit, stall_timeout)
+    .then([this] (bool room)
+      {
+        if ( ! room) {
+          cout << "Client stopped reading a streamed response" << endl;
+          failed = true;
+        }
+        return room;
+      });
+}
+
+void JsonArrayStream::close(bool complete) {
+  if (complete)
+    write("]");
+  if ( ! replied) {
+    // The whole array is short enough to send as it is
+    http_response response {complete ? code : status_codes::InternalError};
+    if (complete)
+      response.set_body(held, "application/json");
+    message.reply(response);
+    replied = true;
+    return;
+  }
+  if (deflater && ! failed) {
+    try {
+      send(deflater->finish());
+    }
+    catch (const std::runtime_error& e) {
+      cout << "Compressing a streamed response failed: " << e.what() << endl;
+    }
+  }
+  try {
+    buffer.close(std::ios_base::out).wait();
+  }
+  catch (const std::exception& e) {
+    cout << "Closing streamed response failed: " << e.what() << endl;
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef JsonArrayStream_h
+#define JsonArrayStream_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+#include <cpprest/producerconsumerstream.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "Compression.h"
+
+/*
+  A JSON array response body written one element at a time.
+
+  reply() sends the status and headers immediately, with a chunked
+  body read from a buffer; add() appends an element to that body as
+  soon as it is available. The client therefore receives the first
+  entities of a scan while the rest are still being read from storage.
+
+  add() never waits. Once a batch of elements has been added, the
+  caller waits on drained() before producing more, so that about
+  buffer_limit unsent bytes plus one batch are held and memory does not
+  grow with the size of the array. drained() yields false if the client
+  stops reading for stall_timeout, and the caller should then abandon
+  the scan; so does add() once the stream has failed.
+
+  Call close() exactly once after the last add(), including after a
+  failed add(), to end the body. If the array could not be completed,
+  close(false) ends the body without the closing bracket, so the
+  client cannot mistake the partial array for a whole one.
+
+  If the request's Accept-Encoding allows, the body is compressed
+  (see Compression.h). Its coding must be chosen before the headers are
+  sent, so reply() then holds them back until compression_threshold
+  bytes of the array have been added: a shorter array is sent whole and
+  uncompressed by close(), or answered 500 by close(false). Compressed
+  output reaches the client as zlib produces it, a block at a time.
+*/
+class JsonArrayStream {
+private:
+  concurrency::streams::producer_consumer_buffer<std::uint8_t> buffer;
+  std::size_t buffer_limit;
+  std::chrono::steady_clock::duration stall_timeout;
+  bool empty;
+  bool failed;
+  web::http::http_request message;
+  web::http::status_code code;
+  content_coding coding;
+  bool replied; // The status and headers have been sent
+  std::string held; // The start of the body, while its coding is undecided
+  std::unique_ptr<Deflater> deflater; // Set if the body is compressed
+  std::string element_text; // Reused by add_json()
+
+  void start();
+  bool write(const std::string& bytes);
+  bool send(const std::string& bytes);
+public:
+  JsonArrayStream (std::size_t limit = 64 * 1024,
+                   std::chrono::steady_clock::duration timeout = std::chrono::seconds {30});
+
+  JsonArrayStream (const JsonArrayStream&) = delete;
+  JsonArrayStream& operator= (const JsonArrayStream&) = delete;
+
+  void reply(const web::http::http_request& message,
+             web::http::status_code code = web::http::status_codes::OK);
+
+  bool add(const web::json::value& element);
+
+  // Add an element already serialized as JSON text
+  bool add_json(const std::string& element);
+
+  /*
+    A task that yields true once fewer than buffer_limit bytes are
+    unsent, or false if the client stopped reading. No thread is
+    blocked while it waits.
+  */
+  pplx::task<bool> drained();
+
+  void close(bool complete = true);
+};
+
+#endif
@@ -0,0 +1,208 @@
+#include "KeyFilter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::unique_ptr;
+
+using std::chrono::steady_clock;
+
+/*
+  Second, independent hash for double hashing (64-bit FNV-1a)
+*/
+static uint64_t fnv1a (const string& s) {
+  uint64_t h {14695981039346656037ULL};
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+BloomFilter::BloomFilter (size_t expected_items, double fp_rate) {
+  const double ln2 {std::log(2.0)};
+  double n {static_cast<double>(std::max<size_t>(expected_items, 1))};
+  double m {std::ceil(-n * std::log(fp_rate) / (ln2 * ln2))};
+  bit_count = std::max<size_t>(static_cast<size_t>(m), 64);
+  hash_count = std::max(1u, static_cast<unsigned>(std::round(bit_count / n * ln2)));
+  bits.assign((bit_count + 63) / 64, 0);
+}
+
+void BloomFilter::add(const string& item) {
+  uint64_t h1 {std::hash<string> {} (item)};
+  uint64_t h2 {fnv1a(item) | 1};
+  for (unsigned i = 0; i < hash_count; ++i) {
+    uint64_t bit {(h1 + i * h2) % bit_count};
+    bits[bit / 64] |= uint64_t {1} << (bit % 64);
+  }
+}
+
+bool BloomFilter::might_contain(const string& item) const {
+  uint64_t h1 {std::hash<string> {} (item)};
+  uint64_t h2 {fnv1a(item) | 1};
+  for (unsigned i = 0; i < hash_count; ++i) {
+    uint64_t bit {(h1 + i * h2) % bit_count};
+    if ((bits[bit / 64] & (uint64_t {1} << (bit % 64))) == 0)
+      return false;
+  }
+  return true;
+}
+
+/*
+  Filter items for a key and for its partition. Azure Storage does not
+  allow control characters in keys, so the two kinds cannot collide.
+*/
+static string key_item (const string& partition, const string& row) {
+  string item {partition};
+  item += '\x1f';
+  item += row;
+  return item;
+}
+
+static string partition_item (const string& partition) {
+  return partition + '\x1e';
+}
+
+bool KeyFilter::is_current(const table_filter& f) const {
+  return f.current && steady_clock::now() - f.built < ttl;
+}
+
+unique_ptr<BloomFilter> KeyFilter::make_filter(size_t expected_keys) const {
+  // Leave room for growth, as the filter cannot be resized
+  return unique_ptr<BloomFilter> {new BloomFilter {std::max(min_keys, 2 * expected_keys), fp_rate}};
+}
+
+bool KeyFilter::definitely_missing(const string& table,
+                                   const string& partition,
+                                   const string& row) {
+  scoped_critical_section_t l {lock};
+  auto f (filters.find(table));
+  if (f == filters.end() || ! is_current(f->second))
+    return false;
+  return ! f->second.current->might_contain(key_item(partition, row));
+}
+
+bool KeyFilter::partition_definitely_missing(const string& table,
+                                             const string& partition) {
+  scoped_critical_section_t l {lock};
+  auto f (filters.find(table));
+  if (f == filters.end() || ! is_current(f->second))
+    return false;
+  return ! f->second.current->might_contain(partition_item(partition));
+}
+
+bool KeyFilter::may_rebuild(const table_filter& f, steady_clock::time_point now) const {
+  return ! f.building && now >= f.recent_complete && now >= f.retry_after;
+}
+
+bool KeyFilter::needs_rebuild(const string& table) {
+  scoped_critical_section_t l {lock};
+  auto f (filters.find(table));
+  if (f == filters.end())
+    return true;
+  return ! is_current(f->second) && may_rebuild(f->second, steady_clock::now());
+}
+
+void KeyFilter::add(const string& table,
+                    const string& partition,
+                    const string& row) {
+  scoped_critical_section_t l {lock};
+  // Kept even without a filter, for the next rebuild to start with
+  table_filter& tf (filters[table]);
+  const steady_clock::time_point now {steady_clock::now()};
+  while ( ! tf.recent.empty() && now - tf.recent.front().added > write_window)
+    tf.recent.pop_front();
+  if (tf.recent.size() == max_recent) {
+    tf.recent_complete = tf.recent.front().added + write_window;
+    tf.recent.pop_front();
+  }
+  tf.recent.push_back(recent_key {now, partition, row});
+
+  if (tf.current) {
+    tf.current->add(key_item(partition, row));
+    tf.current->add(partition_item(partition));
+    ++tf.key_count;
+  }
+  if (tf.building) {
+    tf.building->add(key_item(partition, row));
+    tf.building->add(partition_item(partition));
+    ++tf.building_count;
+  }
+}
+
+void KeyFilter::reset_empty(const string& table) {
+  scoped_critical_section_t l {lock};
+  table_filter& tf (filters[table]);
+  tf.current = make_filter(0);
+  tf.built = steady_clock::now();
+  tf.key_count = 0;
+  // A rebuild still running scanned the old table
+  tf.building.reset();
+}
+
+void KeyFilter::drop_table(const string& table) {
+  scoped_critical_section_t l {lock};
+  filters.erase(table);
+}
+
+bool KeyFilter::begin_rebuild(const string& table) {
+  scoped_critical_section_t l {lock};
+  table_filter& tf (filters[table]);
+  const steady_clock::time_point now {steady_clock::now()};
+  if ( ! may_rebuild(tf, now))
+    return false;
+  tf.building = make_filter(tf.key_count);
+  tf.building_count = 0;
+  // Their writes may land after the scan has passed them
+  for (const auto& k : tf.recent) {
+    if (now - k.added > write_window)
+      continue;
+    tf.building->add(key_item(k.partition, k.row));
+    tf.building->add(partition_item(k.partition));
+    ++tf.building_count;
+  }
+  return true;
+}
+
+void KeyFilter::add_scanned(const string& table,
+                            const string& partition,
+                            const string& row) {
+  scoped_critical_section_t l {lock};
+  auto f (filters.find(table));
+  if (f == filters.end() || ! f->second.building)
+    return;
+  f->second.building->add(key_item(partition, row));
+  f->second.building->add(partition_item(partition));
+  ++f->second.building_count;
+}
+
+void KeyFilter::finish_rebuild(const string& table) {
+  scoped_critical_section_t l {lock};
+  auto f (filters.find(table));
+  if (f == filters.end() || ! f->second.building)
+    return;
+  table_filter& tf (f->second);
+  tf.current = std::move(tf.building);
+  tf.key_count = tf.building_count;
+  tf.built = steady_clock::now();
+}
+
+void KeyFilter::abort_rebuild(const string& table) {
+  scoped_critical_section_t l {lock};
+  auto f (filters.find(table));
+  if (f == filters.end())
+    return;
+  f->second.building.reset();
+  f->second.retry_after = steady_clock::now() + retry_interval;
+}
@@ -0,0 +1,158 @@
+#ifndef KeyFilter_h
+#define KeyFilter_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  Fixed-size Bloom filter of strings
+*/
+class BloomFilter {
+private:
+  std::vector<std::uint64_t> bits;
+  std::size_t bit_count;
+  unsigned hash_count;
+public:
+  /*
+    Size the filter for expected_items at the requested
+    false positive rate.
+  */
+  BloomFilter (std::size_t expected_items, double fp_rate);
+
+  void add(const std::string& item);
+  bool might_contain(const std::string& item) const;
+};
+
+/*
+  Per-table Bloom filters of the (partition, row) keys and
+  partitions known to exist, used to answer definite misses
+  without a storage call.
+
+  A table's filter can only prove absence once it is complete: it
+  must have been built from a scan of every key in the table, and
+  every insert since must have been added to it. Inserts made during
+  a rebuild are added to both the old and the new filter. Deleted keys
+  cannot be removed, so they only cause false positives.
+
+  A key is added before it is written, so a write may still be on its
+  way to storage when a rebuild's scan passes its key. Every key added
+  in the last write_window is therefore kept, at most max_recent per
+  table, and a new filter starts with them. A rebuild cannot begin
+  while keys younger than write_window have been dropped for lack of
+  room, nor for retry_interval after one failed.
+
+  A filter is trusted for ttl after it was built, bounding the damage
+  from inserts made by clients other than this server; after that it
+  must be rebuilt.
+
+  Filters are sized from the key count of the previous build, so the
+  first build of a large table has a higher false positive rate until
+  it is rebuilt.
+*/
+class KeyFilter {
+private:
+  struct recent_key {
+    std::chrono::steady_clock::time_point added;
+    std::string partition;
+    std::string row;
+  };
+
+  struct table_filter {
+    std::unique_ptr<BloomFilter> current {}; // Null until the first build
+    std::unique_ptr<BloomFilter> building {}; // Non-null while a rebuild runs
+    std::chrono::steady_clock::time_point built {};
+    std::size_t key_count {0}; // Keys added to current
+    std::size_t building_count {0}; // Keys added to building
+    std::deque<recent_key> recent {}; // Keys added in the last write_window, oldest first
+    std::chrono::steady_clock::time_point recent_complete {}; // recent lacks keys whose writes may end before this
+    std::chrono::steady_clock::time_point retry_after {}; // No rebuild may begin before this
+  };
+
+  std::unordered_map<std::string,table_filter> filters;
+  pplx::extensibility::critical_section_t lock;
+  std::size_t min_keys;
+  double fp_rate;
+  std::chrono::steady_clock::duration ttl;
+  std::chrono::steady_clock::duration write_window;
+  std::size_t max_recent;
+  std::chrono::steady_clock::duration retry_interval;
+
+  bool is_current(const table_filter& f) const;
+  bool may_rebuild(const table_filter& f, std::chrono::steady_clock::time_point now) const;
+  std::unique_ptr<BloomFilter> make_filter(std::size_t expected_keys) const;
+public:
+  KeyFilter (std::size_t min_expected_keys = 100000,
+             double false_positive_rate = 0.01,
+             std::chrono::steady_clock::duration filter_ttl = std::chrono::minutes {10},
+             std::chrono::steady_clock::duration longest_write = std::chrono::minutes {1},
+             std::size_t max_recent_keys = 10000,
+             std::chrono::steady_clock::duration failed_rebuild_delay = std::chrono::minutes {1}) :
+    filters {},
+    lock {},
+    min_keys {min_expected_keys},
+    fp_rate {false_positive_rate},
+    ttl {filter_ttl},
+    write_window {longest_write},
+    max_recent {max_recent_keys},
+    retry_interval {failed_rebuild_delay}
+    {};
+
+  KeyFilter (const KeyFilter&) = delete;
+  KeyFilter& operator= (const KeyFilter&) = delete;
+
+  /*
+    Return true if the table's filter is current and shows
+    that the key or partition does not exist.
+  */
+  bool definitely_missing(const std::string& table,
+                          const std::string& partition,
+                          const std::string& row);
+  bool partition_definitely_missing(const std::string& table,
+                                    const std::string& partition);
+
+  /*
+    Return true if the table has no current filter, no rebuild
+    is running and one may begin.
+  */
+  bool needs_rebuild(const std::string& table);
+
+  /*
+    Record a key about to be written to the table
+  */
+  void add(const std::string& table,
+           const std::string& partition,
+           const std::string& row);
+
+  /*
+    The table has just been created, so it is known to be empty
+  */
+  void reset_empty(const std::string& table);
+
+  /*
+    The table has been deleted
+  */
+  void drop_table(const std::string& table);
+
+  /*
+    Rebuild protocol: begin_rebuild() returns false if a rebuild of
+    the table is already running or may not begin yet. Otherwise the
+    caller scans every key of the table, passing each to add_scanned(),
+    then calls finish_rebuild(), or abort_rebuild() if the scan failed.
+  */
+  bool begin_rebuild(const std::string& table);
+  void add_scanned(const std::string& table,
+                   const std::string& partition,
+                   const std::string& row);
+  void finish_rebuild(const std::string& table);
+  void abort_rebuild(const std::string& table);
+};
+
+#endif
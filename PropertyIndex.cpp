@@ -0,0 +1,247 @@
+#include "PropertyIndex.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::pair;
+using std::size_t;
+using std::string;
+using std::unordered_set;
+using std::vector;
+
+using std::chrono::steady_clock;
+
+/*
+  Azure Storage does not allow control characters in keys,
+  so the separator cannot occur in a partition or row.
+*/
+static constexpr char key_separator {'\x1f'};
+
+string PropertyIndex::make_key(const string& partition, const string& row) {
+  string key {partition};
+  key += key_separator;
+  key += row;
+  return key;
+}
+
+void PropertyIndex::postings::add(const string& key, const vector<string>& names) {
+  vector<string>& have (properties_by_key[key]);
+  for (const auto& n : names) {
+    if (std::find(have.begin(), have.end(), n) != have.end())
+      continue;
+    have.push_back(n);
+    keys_by_property[n].insert(key);
+  }
+}
+
+void PropertyIndex::postings::remove(const string& key) {
+  auto k (properties_by_key.find(key));
+  if (k == properties_by_key.end())
+    return;
+  for (const auto& n : k->second) {
+    auto p (keys_by_property.find(n));
+    if (p == keys_by_property.end())
+      continue;
+    p->second.erase(key);
+    if (p->second.empty())
+      keys_by_property.erase(p);
+  }
+  properties_by_key.erase(k);
+}
+
+bool PropertyIndex::is_current(const table_index& ti) const {
+  return ti.current && steady_clock::now() - ti.built < ttl;
+}
+
+bool PropertyIndex::lookup(const string& table,
+                           const vector<string>& names,
+                           size_t max_matches,
+                           vector<pair<string,string>>& keys) {
+  keys.clear();
+  scoped_critical_section_t l {lock};
+  auto t (indexes.find(table));
+  if (t == indexes.end() || ! is_current(t->second))
+    return false;
+  const postings& p (*t->second.current);
+
+  // Walk the shortest posting list, probing the others
+  vector<const unordered_set<string>*> lists;
+  for (const auto& n : names) {
+    auto list (p.keys_by_property.find(n));
+    if (list == p.keys_by_property.end())
+      return true; // No entity has this property
+    lists.push_back(&list->second);
+  }
+  if (lists.empty())
+    return false;
+  std::sort(lists.begin(), lists.end(),
+            [] (const unordered_set<string>* a, const unordered_set<string>* b) { return a->size() < b->size(); });
+
+  vector<string> matches;
+  for (const auto& key : *lists[0]) {
+    bool all {true};
+    for (size_t i = 1; i < lists.size() && all; ++i)
+      all = lists[i]->count(key) != 0;
+    if ( ! all)
+      continue;
+    if (matches.size() == max_matches)
+      return false;
+    matches.push_back(key);
+  }
+  // Answer in the order a scan of the table would
+  std::sort(matches.begin(), matches.end());
+  for (const auto& key : matches) {
+    size_t sep {key.find(key_separator)};
+    keys.push_back(make_pair(key.substr(0, sep), key.substr(sep + 1)));
+  }
+  return true;
+}
+
+bool PropertyIndex::needs_rebuild(const string& table) {
+  scoped_critical_section_t l {lock};
+  auto t (indexes.find(table));
+  if (t == indexes.end())
+    return true;
+  return ! is_current(t->second) && ! t->second.building &&
+    steady_clock::now() >= t->second.rebuild_after;
+}
+
+void PropertyIndex::merge(const string& table,
+                          const string& partition,
+                          const string& row,
+                          const vector<string>& names) {
+  scoped_critical_section_t l {lock};
+  auto t (indexes.find(table));
+  if (t == indexes.end())
+    return;
+  string key {make_key(partition, row)};
+  if (t->second.current) {
+    t->second.current->add(key, names);
+    if (t->second.current->properties_by_key.size() > max_entities)
+      t->second.current.reset();
+  }
+  if (t->second.building) {
+    t->second.building->add(key, names);
+    if (t->second.building->properties_by_key.size() > max_entities)
+      t->second.building.reset();
+  }
+}
+
+void PropertyIndex::merge_all(const string& table, const vector<string>& names) {
+  scoped_critical_section_t l {lock};
+  auto t (indexes.find(table));
+  if (t == indexes.end())
+    return;
+  for (postings* p : {t->second.current.get(), t->second.building.get()}) {
+    if ( ! p)
+      continue;
+    for (auto& k : p->properties_by_key) {
+      for (const auto& n : names) {
+        if (std::find(k.second.begin(), k.second.end(), n) == k.second.end()) {
+          k.second.push_back(n);
+          p->keys_by_property[n].insert(k.first);
+        }
+      }
+    }
+  }
+  // Entities the scan has yet to add may have been read before this write
+  if (t->second.building) {
+    vector<string>& added (t->second.building->added_to_all);
+    added.insert(added.end(), names.begin(), names.end());
+  }
+}
+
+void PropertyIndex::remove(const string& table,
+                           const string& partition,
+                           const string& row) {
+  scoped_critical_section_t l {lock};
+  auto t (indexes.find(table));
+  if (t == indexes.end())
+    return;
+  string key {make_key(partition, row)};
+  if (t->second.current)
+    t->second.current->remove(key);
+  if (t->second.building) {
+    t->second.building->remove(key);
+    t->second.building->written.insert(key);
+  }
+}
+
+void PropertyIndex::reset_empty(const string& table) {
+  scoped_critical_section_t l {lock};
+  table_index& ti (indexes[table]);
+  ti.current.reset(new postings {});
+  ti.built = steady_clock::now();
+  // A rebuild still running scanned the old table
+  ti.building.reset();
+}
+
+void PropertyIndex::drop_table(const string& table) {
+  scoped_critical_section_t l {lock};
+  auto t (indexes.find(table));
+  if (t == indexes.end())
+    return;
+  // The entry stays, so that the next rebuild still waits for rebuild_after
+  t->second.current.reset();
+  t->second.building.reset();
+}
+
+bool PropertyIndex::begin_rebuild(const string& table) {
+  scoped_critical_section_t l {lock};
+  table_index& ti (indexes[table]);
+  const steady_clock::time_point now {steady_clock::now()};
+  if (ti.building || now < ti.rebuild_after)
+    return false;
+  ti.building.reset(new postings {});
+  ti.rebuild_after = now + rebuild_interval;
+  return true;
+}
+
+bool PropertyIndex::add_scanned(const string& table,
+                                const string& partition,
+                                const string& row,
+                                const vector<string>& names) {
+  scoped_critical_section_t l {lock};
+  auto t (indexes.find(table));
+  if (t == indexes.end() || ! t->second.building)
+    return false;
+  postings& p (*t->second.building);
+  string key {make_key(partition, row)};
+  if (p.written.count(key) != 0)
+    return true;
+  p.add(key, names);
+  p.add(key, p.added_to_all);
+  if (p.properties_by_key.size() > max_entities) {
+    // Too large to index; the table will be scanned instead
+    t->second.building.reset();
+    return false;
+  }
+  return true;
+}
+
+void PropertyIndex::finish_rebuild(const string& table) {
+  scoped_critical_section_t l {lock};
+  auto t (indexes.find(table));
+  if (t == indexes.end() || ! t->second.building)
+    return;
+  table_index& ti (t->second);
+  ti.current = std::move(ti.building);
+  ti.current->written.clear();
+  ti.current->added_to_all.clear();
+  ti.built = steady_clock::now();
+}
+
+void PropertyIndex::abort_rebuild(const string& table) {
+  scoped_critical_section_t l {lock};
+  auto t (indexes.find(table));
+  if (t != indexes.end())
+    t->second.building.reset();
+}
@@ -0,0 +1,152 @@
+#ifndef PropertyIndex_h
+#define PropertyIndex_h
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  Per-table inverted index from property names to the
+  (partition, row) keys of the entities that have them, so that
+  the entities having every one of a set of properties are found
+  by intersecting posting lists instead of scanning the table.
+
+  Like KeyFilter, a table's index is only usable once it has been
+  built from a scan of the whole table, and every write since must
+  have been recorded in it. Writes made during a rebuild are
+  recorded in both the old and the new index. An index is trusted
+  for ttl after it was built, bounding the damage from writes made
+  by clients other than this server.
+
+  Writes are only ever merges, so recording a write adds names to
+  an entity and never removes any. Recording a write before making
+  it can therefore only make the index list too many entities,
+  which callers must tolerate by checking the entities they read.
+
+  Memory is bounded by indexing at most max_entities entities of a
+  table: a rebuild that scans more is abandoned, and an index that
+  writes grow past it is discarded, leaving the table to be scanned.
+  Every rebuild is a scan of the whole table, so a table's rebuilds
+  begin at most once per rebuild_interval. That includes the rebuild
+  after drop_table(), which is only called when a table is deleted or
+  had properties of unknown names written to every entity.
+*/
+class PropertyIndex {
+private:
+  struct postings {
+    // Property name -> keys of the entities having it
+    std::unordered_map<std::string,std::unordered_set<std::string>> keys_by_property {};
+    // Entity key -> its property names
+    std::unordered_map<std::string,std::vector<std::string>> properties_by_key {};
+    // While building: keys whose names are fully known from writes, so scanned names are stale
+    std::unordered_set<std::string> written {};
+    // While building: names added to every entity since the scan began
+    std::vector<std::string> added_to_all {};
+
+    void add(const std::string& key, const std::vector<std::string>& names);
+    void remove(const std::string& key);
+  };
+
+  struct table_index {
+    std::unique_ptr<postings> current {}; // Null until the first build
+    std::unique_ptr<postings> building {}; // Non-null while a rebuild runs
+    std::chrono::steady_clock::time_point built {};
+    std::chrono::steady_clock::time_point rebuild_after {}; // No rebuild may begin before this
+  };
+
+  std::unordered_map<std::string,table_index> indexes;
+  pplx::extensibility::critical_section_t lock;
+  std::chrono::steady_clock::duration ttl;
+  std::size_t max_entities;
+  std::chrono::steady_clock::duration rebuild_interval;
+
+  bool is_current(const table_index& ti) const;
+  static std::string make_key(const std::string& partition, const std::string& row);
+public:
+  PropertyIndex (std::chrono::steady_clock::duration index_ttl = std::chrono::minutes {10},
+                 std::size_t max_table_entities = 100000,
+                 std::chrono::steady_clock::duration min_rebuild_interval = std::chrono::minutes {1}) :
+    indexes {},
+    lock {},
+    ttl {index_ttl},
+    max_entities {max_table_entities},
+    rebuild_interval {min_rebuild_interval}
+    {};
+
+  PropertyIndex (const PropertyIndex&) = delete;
+  PropertyIndex& operator= (const PropertyIndex&) = delete;
+
+  /*
+    If the table's index is current, set keys to the (partition, row)
+    of every entity having all the named properties, in key order,
+    and return true. Return false if the index cannot be used or more
+    than max_matches entities have the properties.
+  */
+  bool lookup(const std::string& table,
+              const std::vector<std::string>& names,
+              std::size_t max_matches,
+              std::vector<std::pair<std::string,std::string>>& keys);
+
+  /*
+    Return true if the table has no current index, no rebuild is
+    running and one may begin.
+  */
+  bool needs_rebuild(const std::string& table);
+
+  /*
+    Record a merge of the named properties into an entity,
+    which is created if it does not exist
+  */
+  void merge(const std::string& table,
+             const std::string& partition,
+             const std::string& row,
+             const std::vector<std::string>& names);
+
+  /*
+    Record a merge of the named properties into every entity of the table
+  */
+  void merge_all(const std::string& table, const std::vector<std::string>& names);
+
+  /*
+    Record the deletion of an entity
+  */
+  void remove(const std::string& table,
+              const std::string& partition,
+              const std::string& row);
+
+  /*
+    The table has just been created, so it is known to be empty
+  */
+  void reset_empty(const std::string& table);
+
+  /*
+    The table has been deleted, or its index can no longer be kept
+    up to date
+  */
+  void drop_table(const std::string& table);
+
+  /*
+    Rebuild protocol, as for KeyFilter: begin_rebuild() returns false
+    if a rebuild of the table is already running or began less than
+    rebuild_interval ago. Otherwise the caller scans every entity of
+    the table, passing its key and property names to add_scanned(),
+    then calls finish_rebuild(), or abort_rebuild() if the scan failed.
+    add_scanned() returns false once the table has too many entities
+    to index, and the scan may stop.
+  */
+  bool begin_rebuild(const std::string& table);
+  bool add_scanned(const std::string& table,
+                   const std::string& partition,
+                   const std::string& row,
+                   const std::vector<std::string>& names);
+  void finish_rebuild(const std::string& table);
+  void abort_rebuild(const std::string& table);
+};
+
+#endif
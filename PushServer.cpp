@@ -1,4 +1,5 @@
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -10,6 +11,8 @@
 #include <was/table.h>
 
 #include "TableCache.h"
+#include "RequestExecutor.h"
+#include "Router.h"
 #include "make_unique.h"
 
 #include "azure_keys.h"
@@ -53,9 +56,8 @@ using web::http::experimental::listener::http_listener;
 using prop_vals_t = vector<pair<string,value>>;
 using prop_str_vals_t = vector<pair<string,string>>;
 
-const string push_status {"PushStatus"};
 const string update_entity_admin {"UpdateEntityAdmin"};
-const string read_entity_admin {"ReadEntityAdmin"};
+const string read_entities_admin {"ReadEntitiesAdmin"};
 
 constexpr const char* def_url = "http://localhost:34574";
 
@@ -67,6 +69,12 @@ static constexpr const char* push_addr {"http://localhost:34574/"};
 
 string DataTable {"DataTable"};
 
+/*
+  Queue between the listener and the handlers; each handler waits
+  for BasicServer, so it has a worker per concurrent request
+*/
+RequestExecutor executor {32, 1000, 32};
+
 unordered_map<string,string> get_json_body(http_request message) {  
   unordered_map<string,string> results {};
   const http_headers& headers {message.headers()};
@@ -106,17 +114,28 @@ int put_entity(const string& partition, const string& row, const string& prop, c
   return result.first;
 }
 
-pair<status_code,value> get_partition_entity (const string& addr, const string& table, const string& partition, const string& row){
-	pair<status_code,value> result {do_request(methods::GET, addr + read_entity_admin + "/" + table + "/" + partition + "/" + row) };
+/*
+  Read the Updates property of every friend's entity in one request.
+  Friends without an entity are left out of the returned array.
+*/
+pair<status_code,value> get_friend_entities (const string& addr, const string& table, const friends_list_t& friends){
+	vector<value> keys;
+	for( const auto& f : friends ){
+		keys.push_back(value::object(prop_vals_t { make_pair("Partition", value::string(f.first)), make_pair("Row", value::string(f.second)) }));
+	}
+	pair<status_code,value> result {do_request(methods::GET, addr + read_entities_admin + "/" + table + "?select=Updates", value::array(keys)) };
 	return result;
 }
 
 void handle_post(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** POST " << path << endl;
-  auto paths = uri::split_path(path);
-	// cout << "The size of paths is: " << paths.size() << endl;
-	if( paths[0] == push_status ){
+  const RequestPath path {message.request_uri().path()};
+  cout << endl << "**** POST " << path.text() << endl;
+	// path[0] == PushStatus | path[1] == <Country> | path[2] == <Last Name, First Name> | path[3] == <Status>
+	if( path.operation() == command::push_status ){
+		if( path.size() < 4 ){
+			message.reply(status_codes::BadRequest);
+			return;
+		}
 		unordered_map<string,string> stored_message = get_json_body(message);
 		unordered_map<string,string>::const_iterator got = stored_message.find("Friends");
 		string all_friends {};
@@ -128,52 +147,24 @@ void handle_post(http_request message) {
 			return;
 		}
 		else{
-			got = stored_message.find("Friends");
-			if( got != stored_message.end() ){
-				all_friends = got->second;
-			}
-			string current_friend {};
-			if(all_friends.find("|") == string::npos){ // This user only has one friend
-				current_friend = all_friends;
-			}
-			else{
-				current_friend = all_friends.substr( 0, all_friends.find("|") ); // The first of the multiple friends this user has
-			}
-			string current_country {};
-			string current_name {};
-			string current_properties {};
 			string prop {"Updates"};
-			bool done {false};
-			unordered_map<string,string> extract_json {};
-			while( !done ){
-				current_country = current_friend.substr( 0, current_friend.find(";") ); // Parse out the country from current_friend
-				current_name = current_friend.substr( current_friend.find(";")+1, current_friend.length() ); // Parse out the name from current_friend
-				
-				pair<status_code,value> get_result { get_partition_entity(basic_addr, DataTable, current_country, current_name) };
-				if( get_result.first == status_codes::OK ){ // If not OK, then the entity does not exist
-					for ( const auto& v : get_result.second.as_object() ){
-						if(v.first == "Updates") extract_json[v.first] = v.second.as_string();
-					}
-					unordered_map<string,string>::const_iterator got = extract_json.find("Updates");
-					if( got == extract_json.end() ){ // The user that we're trying to access does not have the property "Updates"
-						int update_result = put_entity(current_country, current_name, prop, paths[3]+"\n" );
-					}
-					else{
-						current_properties = got->second;
-						int update_result = put_entity(current_country, current_name, prop, current_properties+paths[3]+"\n" );
+			const string status {path[3]};
+			friends_list_t friends {};
+			try{
+				friends = parse_friends_list(all_friends);
+			}catch(const std::invalid_argument& e){ // A friend without a country
+				message.reply(status_codes::BadRequest);
+				return;
+			}
+			pair<status_code,value> get_result { get_friend_entities(basic_addr, DataTable, friends) };
+			if( get_result.first == status_codes::OK && get_result.second.is_array() ){
+				for ( const auto& e : get_result.second.as_array() ){
+					string current_properties {};
+					if( e.has_field(prop) ){ // Friends without the property "Updates" start with an empty one
+						current_properties = e.at(prop).as_string();
 					}
+					int update_result = put_entity(e.at("Partition").as_string(), e.at("Row").as_string(), prop, current_properties+status+"\n" );
 				}
-				/*
-				cout << "Current Friend is: " << current_friend << endl;
-				cout << "Current Country is: " << current_country << endl;
-				cout << "Current Name is: " << current_name << endl;
-				*/
-				if( all_friends.find("|") == string::npos ){ // The last friend has been updated
-					done = true;
-				}
-				all_friends.erase( 0, all_friends.find("|")+1 );
-				// cout << "All Friends is now: " << all_friends << endl;
-				current_friend = all_friends.substr(0, all_friends.find("|"));
 			}
 			message.reply(status_codes::OK);
 			return;
@@ -181,7 +172,7 @@ void handle_post(http_request message) {
 		
 	}
 	
-	// If the code reaches here, then a Malformed Request was done (eg. paths[0] == "DoSomething")
+	// If the code reaches here, then a Malformed Request was done (eg. path[0] == "DoSomething")
 	message.reply(status_codes::BadRequest);
 	return;
 }
@@ -193,7 +184,7 @@ int main (int argc, char const * argv[]) {
   cout << "PushServer: Opening listener" << endl;
   http_listener listener {def_url};
   //listener.support(methods::GET, &handle_get);
-  listener.support(methods::POST, &handle_post);
+  listener.support(methods::POST, executor.admit(&handle_post));
   //listener.support(methods::PUT, &handle_put);
   //listener.support(methods::DEL, &handle_delete);
   listener.open().wait(); // Wait for listener to complete starting
@@ -203,6 +194,8 @@ int main (int argc, char const * argv[]) {
   getline(std::cin, line);
 
   // Shut it down
+  executor.stop();
   listener.close().wait();
+  cout << "PushServer requests: " << executor.get_metrics() << endl;
   cout << "PushServer closed" << endl;
 }
@@ -0,0 +1,252 @@
+/*
+  Bounded admission of HTTP requests
+ */
+
+#include "RequestExecutor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <initializer_list>
+#include <iostream>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <utility>
+
+#include <cpprest/http_msg.h>
+
+#include <pplx/pplxtasks.h>
+
+using std::cout;
+using std::endl;
+
+using web::http::header_names;
+using web::http::http_request;
+using web::http::http_response;
+using web::http::status_codes;
+
+using guard_t = std::unique_lock<std::mutex>;
+
+RequestExecutor::lane_queue::lane_queue (std::size_t in_flight_limit) :
+  queue {}, max_in_flight {in_flight_limit}, in_flight {0},
+  first_above_time {}, drop_next {}, drop_count {0}, dropping {false},
+  handled {0}, rejected {0}, shed {0}, total_delay {0}, max_delay {0}
+{}
+
+RequestExecutor::RequestExecutor (std::size_t worker_count, std::size_t queue_limit, std::size_t in_flight_limit,
+                                  std::size_t bulk_in_flight_limit,
+                                  clock::duration target, clock::duration shed_interval, int retry_after) :
+  lock {}, ready {}, idle {},
+  interactive {in_flight_limit}, bulk {std::min(bulk_in_flight_limit, in_flight_limit)},
+  workers {}, max_queue {queue_limit}, max_in_flight {in_flight_limit},
+  target_delay {target}, interval {shed_interval}, retry_after_seconds {retry_after},
+  stopping {false}
+{
+  for (std::size_t i = 0; i < worker_count; ++i)
+    workers.push_back(std::thread {[this] () { run(); }});
+}
+
+RequestExecutor::~RequestExecutor () {
+  stop();
+}
+
+RequestExecutor::lane_queue& RequestExecutor::queue_for(lane l) {
+  return l == lane::bulk ? bulk : interactive;
+}
+
+void RequestExecutor::refuse(const http_request& message) {
+  http_response response {status_codes::ServiceUnavailable};
+  response.headers().add(header_names::retry_after, retry_after_seconds);
+  message.reply(response);
+}
+
+void RequestExecutor::submit(const http_request& message, handler_t handler, lane l) {
+  {
+    guard_t g {lock};
+    lane_queue& q (queue_for(l));
+    if ( ! stopping && q.queue.size() < max_queue) {
+      q.queue.push_back(entry {message, std::move(handler), clock::now()});
+      ready.notify_one();
+      return;
+    }
+    ++q.rejected;
+  }
+  refuse(message);
+}
+
+RequestExecutor::handler_t RequestExecutor::admit(handler_t handler, classifier_t classify) {
+  return [this, handler, classify] (http_request message)
+    {
+      submit(message, handler, classify ? classify(message) : lane::interactive);
+    };
+}
+
+/*
+  Return true if a request can be taken from q without exceeding
+  its lane's limit or the executor's. Must be called with lock held.
+*/
+bool RequestExecutor::can_dequeue(const lane_queue& q) const {
+  return ! q.queue.empty() && q.in_flight < q.max_in_flight &&
+    interactive.in_flight + bulk.in_flight < max_in_flight;
+}
+
+/*
+  Decide whether to shed a request that waited delay in q, as CoDel
+  decides whether to drop a packet. Must be called with lock held,
+  after the request has been dequeued.
+*/
+bool RequestExecutor::should_shed(lane_queue& q, clock::duration delay, clock::time_point now) {
+  bool above {false};
+  if (delay < target_delay || q.queue.empty()) {
+    // The wait is short or the queue is draining
+    q.first_above_time = clock::time_point {};
+  }
+  else if (q.first_above_time == clock::time_point {}) {
+    q.first_above_time = now + interval;
+  }
+  else if (now >= q.first_above_time) {
+    above = true;
+  }
+
+  // Shed more often the longer the delay stays above target
+  auto next_drop = [this, &q] (clock::time_point t) {
+    return t + std::chrono::duration_cast<clock::duration>(interval / std::sqrt(static_cast<double>(q.drop_count)));
+  };
+
+  if (q.dropping) {
+    if ( ! above) {
+      q.dropping = false;
+      return false;
+    }
+    if (now < q.drop_next)
+      return false;
+    ++q.drop_count;
+    q.drop_next = next_drop(q.drop_next);
+    return true;
+  }
+  if ( ! above)
+    return false;
+
+  q.dropping = true;
+  // Resume near the previous rate if shedding stopped only recently
+  q.drop_count = (q.drop_count > 2 && now - q.drop_next < 16 * interval) ? q.drop_count - 2 : 1;
+  q.drop_next = next_drop(now);
+  return true;
+}
+
+void RequestExecutor::finished(lane_queue& q) {
+  guard_t g {lock};
+  --q.in_flight;
+  ready.notify_one();
+  if (interactive.in_flight + bulk.in_flight == 0)
+    idle.notify_all();
+}
+
+void RequestExecutor::run() {
+  for (;;) {
+    entry e {};
+    lane_queue* from {nullptr};
+    bool refused {false};
+    {
+      guard_t g {lock};
+      ready.wait(g, [this] () { return stopping || can_dequeue(interactive) || can_dequeue(bulk); });
+      if (stopping)
+        return;
+      // Interactive requests go first, so a backlog of scans never delays them
+      from = can_dequeue(interactive) ? &interactive : &bulk;
+      e = std::move(from->queue.front());
+      from->queue.pop_front();
+
+      clock::time_point now {clock::now()};
+      clock::duration delay {now - e.arrived};
+      refused = should_shed(*from, delay, now);
+      if (refused) {
+        ++from->shed;
+      }
+      else {
+        ++from->handled;
+        ++from->in_flight;
+        from->total_delay += delay;
+        if (delay > from->max_delay)
+          from->max_delay = delay;
+      }
+    }
+    if (refused) {
+      refuse(e.message);
+      continue;
+    }
+
+    // The request stays in flight until its reply is sent, however the handler sends it
+    e.message.get_response().then([this, from] (pplx::task<http_response> response)
+      {
+        try {
+          response.get();
+        }
+        catch (const std::exception&) {
+          // The client went away; the request is over all the same
+        }
+        finished(*from);
+      });
+    try {
+      e.handler(e.message);
+    }
+    catch (const std::exception& ex) {
+      cout << "Request handler failed: " << ex.what() << endl;
+      try {
+        e.message.reply(status_codes::InternalError);
+      }
+      catch (const std::exception&) {
+        // The handler replied before it failed
+      }
+    }
+  }
+}
+
+void RequestExecutor::stop() {
+  std::deque<entry> refused {};
+  {
+    guard_t g {lock};
+    if (stopping)
+      return;
+    stopping = true;
+    for (lane_queue* q : {&interactive, &bulk}) {
+      q->rejected += q->queue.size();
+      for (auto& e : q->queue)
+        refused.push_back(std::move(e));
+      q->queue.clear();
+    }
+    ready.notify_all();
+  }
+  for (const auto& e : refused)
+    refuse(e.message);
+  for (auto& w : workers)
+    w.join();
+
+  // Handlers may still be answering from continuations
+  guard_t g {lock};
+  idle.wait_for(g, std::chrono::seconds {30}, [this] () { return interactive.in_flight + bulk.in_flight == 0; });
+}
+
+RequestExecutor::metrics RequestExecutor::get_metrics(lane l) {
+  guard_t g {lock};
+  const lane_queue& q (queue_for(l));
+  metrics m {};
+  m.handled = q.handled;
+  m.rejected = q.rejected;
+  m.shed = q.shed;
+  m.queued = q.queue.size();
+  m.in_flight = q.in_flight;
+  m.mean_delay_ms = q.handled == 0 ? 0 :
+    std::chrono::duration<double, std::milli> {q.total_delay}.count() / q.handled;
+  m.max_delay_ms = std::chrono::duration<double, std::milli> {q.max_delay}.count();
+  return m;
+}
+
+std::ostream& operator<< (std::ostream& os, const RequestExecutor::metrics& m) {
+  return os << m.handled << " handled, " << m.rejected << " rejected, " << m.shed << " shed, "
+            << m.queued << " queued, " << m.in_flight << " in flight, queue delay "
+            << m.mean_delay_ms << " ms mean, " << m.max_delay_ms << " ms max";
+}
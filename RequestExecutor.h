@@ -0,0 +1,143 @@
+#ifndef RequestExecutor_h
+#define RequestExecutor_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+/*
+  Admits HTTP requests to a server's handlers through bounded queues.
+
+  The listener's callbacks only queue each request; the executor's own
+  worker threads pass it to its handler. At most max_in_flight requests
+  are being handled at once, counting from when the handler is called
+  until the reply is sent, so a handler that answers from continuations
+  still holds its place until it replies.
+
+  Each request is queued in one of two lanes. Requests in the
+  interactive lane are always dequeued first. Requests in the bulk lane,
+  such as table scans, are only dequeued while fewer than
+  max_bulk_in_flight of them are being handled, so they can never hold
+  all the places, nor delay an interactive request behind them.
+
+  Requests beyond a lane's max_queue are refused at once. Queued requests
+  are shed with CoDel (Nichols and Jacobson, "Controlling Queue Delay"),
+  separately in each lane: once every request has waited longer than
+  target_delay for a whole interval, requests are refused as they are
+  dequeued, at a rate that grows until the waits fall below target_delay
+  again. A refused request is answered 503 with a Retry-After header.
+*/
+class RequestExecutor {
+public:
+  enum class lane { interactive, bulk };
+
+  using handler_t = std::function<void(web::http::http_request)>;
+  using classifier_t = std::function<lane(const web::http::http_request&)>;
+
+  /*
+    Counts for one lane since the executor started. Delays are the
+    time requests waited in the queue before being handled.
+  */
+  struct metrics {
+    unsigned long handled;
+    unsigned long rejected; // Queue full
+    unsigned long shed;     // Waited too long
+    std::size_t queued;
+    std::size_t in_flight;
+    double mean_delay_ms;
+    double max_delay_ms;
+  };
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct entry {
+    web::http::http_request message;
+    handler_t handler;
+    clock::time_point arrived;
+  };
+
+  struct lane_queue {
+    std::deque<entry> queue;
+    std::size_t max_in_flight;
+    std::size_t in_flight;
+
+    // CoDel state
+    clock::time_point first_above_time;
+    clock::time_point drop_next;
+    unsigned drop_count;
+    bool dropping;
+
+    unsigned long handled;
+    unsigned long rejected;
+    unsigned long shed;
+    clock::duration total_delay;
+    clock::duration max_delay;
+
+    lane_queue (std::size_t in_flight_limit);
+  };
+
+  std::mutex lock;
+  std::condition_variable ready;
+  std::condition_variable idle;
+  lane_queue interactive;
+  lane_queue bulk;
+  std::vector<std::thread> workers;
+  std::size_t max_queue;
+  std::size_t max_in_flight;
+  clock::duration target_delay;
+  clock::duration interval;
+  int retry_after_seconds;
+  bool stopping;
+
+  void run();
+  lane_queue& queue_for(lane l);
+  bool can_dequeue(const lane_queue& q) const;
+  bool should_shed(lane_queue& q, clock::duration delay, clock::time_point now);
+  void finished(lane_queue& q);
+  void refuse(const web::http::http_request& message);
+public:
+  RequestExecutor (std::size_t worker_count = 8,
+                   std::size_t queue_limit = 1000,
+                   std::size_t in_flight_limit = 256,
+                   std::size_t bulk_in_flight_limit = 16,
+                   clock::duration target = std::chrono::milliseconds {10},
+                   clock::duration shed_interval = std::chrono::milliseconds {100},
+                   int retry_after = 1);
+  ~RequestExecutor ();
+
+  RequestExecutor (const RequestExecutor&) = delete;
+  RequestExecutor& operator= (const RequestExecutor&) = delete;
+
+  /*
+    Queue message in lane l to be passed to handler, or refuse it
+    if the lane's queue is full or the executor has stopped
+  */
+  void submit(const web::http::http_request& message, handler_t handler, lane l = lane::interactive);
+
+  /*
+    Return a listener callback that submits each request to handler,
+    in the lane that classify chooses, or the interactive lane if
+    classify is empty
+  */
+  handler_t admit(handler_t handler, classifier_t classify = classifier_t {});
+
+  /*
+    Refuse the queued requests, then wait for the workers to finish
+    and for the requests being handled to be answered
+  */
+  void stop();
+
+  metrics get_metrics(lane l = lane::interactive);
+};
+
+std::ostream& operator<< (std::ostream& os, const RequestExecutor::metrics& m);
+
+#endif
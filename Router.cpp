@@ -0,0 +1,185 @@
+/*
+  Routing of request paths to the servers' commands
+ */
+
+#include "Router.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <cpprest/base_uri.h>
+
+using std::string;
+using std::vector;
+
+using web::uri;
+
+namespace {
+  struct command_entry {
+    const char* name;
+    std::size_t size;
+    command id;
+  };
+
+  constexpr std::size_t length (const char* s) {
+    return *s == '\0' ? 0 : 1 + length(s + 1);
+  }
+
+  constexpr command_entry entry (const char* name, command id) {
+    return command_entry {name, length(name), id};
+  }
+
+  constexpr command_entry commands[] {
+    entry("CreateTableAdmin", command::create_table_admin),
+    entry("DeleteTableAdmin", command::delete_table_admin),
+    entry("UpdateEntityAdmin", command::update_entity_admin),
+    entry("DeleteEntityAdmin", command::delete_entity_admin),
+    entry("ReadEntityAdmin", command::read_entity_admin),
+    entry("ReadEntitiesAdmin", command::read_entities_admin),
+    entry("ReadEntityAuth", command::read_entity_auth),
+    entry("UpdateEntityAuth", command::update_entity_auth),
+    entry("AddPropertyAdmin", command::add_property_admin),
+    entry("UpdatePropertyAdmin", command::update_property_admin),
+    entry("GetJobAdmin", command::get_job_admin),
+    entry("CancelJobAdmin", command::cancel_job_admin),
+    entry("BulkUpdateEntityAdmin", command::bulk_update_entity_admin),
+    entry("GetReadToken", command::get_read_token),
+    entry("GetUpdateToken", command::get_update_token),
+    entry("GetUpdateData", command::get_update_data),
+    entry("SignOn", command::sign_on),
+    entry("SignOff", command::sign_off),
+    entry("AddFriend", command::add_friend),
+    entry("UnFriend", command::unfriend),
+    entry("UpdateStatus", command::update_status),
+    entry("ReadFriendList", command::read_friend_list),
+    entry("PushStatus", command::push_status)
+  };
+  constexpr std::size_t command_count {sizeof commands / sizeof commands[0]};
+
+  constexpr std::size_t longest_name (std::size_t i = 0, std::size_t longest = 0) {
+    return i == command_count ? longest
+      : longest_name(i + 1, commands[i].size > longest ? commands[i].size : longest);
+  }
+  constexpr std::size_t longest {longest_name()};
+
+  /*
+    FNV-1a, started from a seed other than its usual offset basis.
+    The seed is the first, counting up from the offset basis, that
+    puts every command in a slot of its own.
+  */
+  constexpr std::uint32_t hash_seed {0x811c9ec4};
+  constexpr std::uint32_t fnv_prime {16777619u};
+
+  constexpr std::uint32_t hash (const char* s, std::size_t n, std::uint32_t h = hash_seed) {
+    return n == 0 ? h : hash(s + 1, n - 1, (h ^ static_cast<unsigned char>(*s)) * fnv_prime);
+  }
+
+  // 64 one-byte slots fill one cache line; the top bits of FNV mix best
+  constexpr unsigned slot_bits {6};
+  constexpr std::size_t slot_count {std::size_t {1} << slot_bits};
+
+  constexpr std::size_t slot (const char* name, std::size_t size) {
+    return hash(name, size) >> (32 - slot_bits);
+  }
+
+  constexpr bool collides (std::size_t i, std::size_t j) {
+    return j < command_count &&
+      (slot(commands[i].name, commands[i].size) == slot(commands[j].name, commands[j].size) || collides(i, j + 1));
+  }
+
+  constexpr bool perfect (std::size_t i = 0) {
+    return i == command_count || ( ! collides(i, i + 1) && perfect(i + 1));
+  }
+
+  static_assert(perfect(), "Two commands share a slot; choose another hash_seed");
+  static_assert(command_count < 256, "Slots hold a command's index in one byte");
+
+  // One more than the index in commands of the command in slot s, or 0 if it is empty
+  constexpr std::uint8_t command_in (std::size_t s, std::size_t i = 0) {
+    return i == command_count ? 0
+      : slot(commands[i].name, commands[i].size) == s ? static_cast<std::uint8_t>(i + 1) : command_in(s, i + 1);
+  }
+
+  struct dispatch_table {
+    std::uint8_t slots[slot_count];
+  };
+
+  // C++11 has no std::index_sequence
+  template <std::size_t... S> struct slot_list {};
+  template <std::size_t N, std::size_t... S> struct make_slot_list : make_slot_list<N - 1, N - 1, S...> {};
+  template <std::size_t... S> struct make_slot_list<0, S...> { using type = slot_list<S...>; };
+
+  template <std::size_t... S>
+  constexpr dispatch_table make_table (slot_list<S...>) {
+    return dispatch_table {{command_in(S)...}};
+  }
+
+  constexpr dispatch_table table {make_table(make_slot_list<slot_count>::type {})};
+}
+
+command find_command(const char* name, std::size_t size) {
+  // Also bounds the recursion of hash()
+  if (size == 0 || size > longest)
+    return command::unknown;
+  const std::uint8_t index {table.slots[slot(name, size)]};
+  if (index == 0)
+    return command::unknown;
+  const command_entry& c (commands[index - 1]);
+  if (c.size != size || std::memcmp(c.name, name, size) != 0)
+    return command::unknown;
+  return c.id;
+}
+
+string command_name(command c) {
+  for (const auto& e : commands)
+    if (e.id == c)
+      return string (e.name, e.size);
+  return string {};
+}
+
+string path_segment::decoded() const {
+  if (std::memchr(data, '%', size) == nullptr)
+    return str();
+  return uri::decode(str());
+}
+
+constexpr std::size_t RequestPath::inline_segments;
+
+RequestPath::RequestPath (const string& path) :
+  path (path),
+  segments {},
+  overflow {},
+  count {0},
+  op {command::unknown}
+{
+  const char* p {path.data()};
+  const char* end {p + path.size()};
+  while (p != end) {
+    const char* start {p};
+    while (p != end && *p != '/')
+      ++p;
+    if (p != start) {
+      const path_segment segment {start, static_cast<std::size_t>(p - start)};
+      if (count < inline_segments)
+        segments[count] = segment;
+      else
+        overflow.push_back(segment);
+      ++count;
+    }
+    if (p != end)
+      ++p;
+  }
+  if (count == 0)
+    return;
+
+  const path_segment& first (segments[0]);
+  op = find_command(first.data, first.size);
+  // A command name spelled with escapes is rare enough to decode
+  if (op == command::unknown && std::memchr(first.data, '%', first.size) != nullptr) {
+    const string name {first.decoded()};
+    op = find_command(name.data(), name.size());
+  }
+}
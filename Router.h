@@ -0,0 +1,117 @@
+#ifndef Router_h
+#define Router_h
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+  Routing of request paths to the servers' commands
+
+  A path such as "/ReadEntityAdmin/DataTable/USA/Smith,John" is split
+  once into segments that point into the path rather than copying it,
+  and its first segment is looked up in a table of every command of
+  the four servers. The table is a perfect hash built at compile time,
+  so finding the command costs one hash of the segment and one
+  comparison with the command's name. Routing a request of up to
+  RequestPath::inline_segments segments allocates nothing. Handlers
+  then decode only the segments they use.
+*/
+
+enum class command : unsigned char {
+  unknown,
+
+  // BasicServer
+  create_table_admin,
+  delete_table_admin,
+  update_entity_admin,
+  delete_entity_admin,
+  read_entity_admin,
+  read_entities_admin,
+  read_entity_auth,
+  update_entity_auth,
+  add_property_admin,
+  update_property_admin,
+  get_job_admin,
+  cancel_job_admin,
+  bulk_update_entity_admin,
+
+  // AuthServer
+  get_read_token,
+  get_update_token,
+  get_update_data,
+
+  // UserServer
+  sign_on,
+  sign_off,
+  add_friend,
+  unfriend,
+  update_status,
+  read_friend_list,
+
+  // PushServer
+  push_status
+};
+
+/*
+  Return the command named by the size characters at name, which
+  must match exactly, or command::unknown
+*/
+command find_command(const char* name, std::size_t size);
+
+// The name of a command in request paths
+std::string command_name(command c);
+
+/*
+  A segment of a path, still percent-encoded. It points into the
+  path it came from, which must outlive it.
+*/
+struct path_segment {
+  const char* data;
+  std::size_t size;
+
+  std::string str() const { return std::string (data, size); }
+  // Throws web::uri_exception if the segment has a malformed escape
+  std::string decoded() const;
+};
+
+/*
+  A request path split into segments at '/', skipping empty ones as
+  uri::split_path() does. Splitting before decoding keeps an encoded
+  '/' (%2F) inside its segment.
+
+  path must outlive the RequestPath. The servers listen at the root,
+  so the path of message.request_uri() is the path relative to the
+  listener and is kept by the message.
+
+  No command takes more than inline_segments segments, so those are
+  held in the RequestPath itself; only a longer path allocates, for
+  the rest. Handlers reject the operands they do not expect.
+*/
+class RequestPath {
+public:
+  static constexpr std::size_t inline_segments {8};
+
+  explicit RequestPath (const std::string& path);
+
+  const std::string& text() const { return path; }
+  std::size_t size() const { return count; }
+  command operation() const { return op; }
+
+  // Segment i, which must be less than size()
+  const path_segment& segment(std::size_t i) const {
+    return i < inline_segments ? segments[i] : overflow[i - inline_segments];
+  }
+
+  // Segment i decoded, which is how the servers compare operands
+  std::string operator[] (std::size_t i) const { return segment(i).decoded(); }
+
+private:
+  const std::string& path;
+  path_segment segments[inline_segments];
+  std::vector<path_segment> overflow;
+  std::size_t count;
+  command op;
+};
+
+#endif
@@ -8,10 +8,13 @@
 #include <string>
 #include <unordered_map>
 #include <utility>
-#include <vector>
+
+#include <pplx/pplxtasks.h>
 
 #include <was/table.h>
 
+#include "Router.h"
+
 using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
 using azure::storage::entity_property;
@@ -27,13 +30,31 @@ using std::make_pair;
 using std::pair;
 using std::string;
 using std::unordered_map;
-using std::vector;
 
+using web::http::header_names;
+using web::http::http_headers;
 using web::http::http_request;
 using web::http::status_code;
 using web::http::status_codes;
 using web::http::uri;
 
+/*
+  Return the status to report for a storage call made with a
+  security token that failed with e
+ */
+status_code token_error (const storage_exception& e) {
+  cout << "Azure Table Storage error: " << e.what() << endl;
+  cout << e.result().extended_error().message() << endl;
+  if (e.result().http_status_code() == status_codes::Forbidden)
+    return status_codes::Forbidden;
+  else if (e.result().http_status_code() == status_codes::NotFound)
+    return status_codes::NotFound;
+  else if (e.result().http_status_code() == status_codes::PreconditionFailed)
+    return status_codes::PreconditionFailed;
+  else
+    return status_codes::InternalError;
+}
+
 /*
   Read from a table using a security token
 
@@ -45,55 +66,50 @@ using web::http::uri;
     "http://STORAGE.table.core.windows.net/", where STORAGE is
     replaced by the user's Azure Storage account name.
 
-  Returns a pair:
+  Returns a task that completes, without blocking the caller, with a pair:
     first: HTTP status code from the read
     second: if the status code is OK, the entity read from the table
  */
-pair<status_code,table_entity> read_with_token (const http_request& message,
-                                                 const string& endpoint) {
+pplx::task<pair<status_code,table_entity>> read_with_token_async (const http_request& message,
+                                                                   const string& endpoint) {
   /*
     Tokens can contain %2F ('/'). Thus we split the URI path
     *before* decoding and pass the undecoded values to Azure Storage
    */
-  const string undecoded_path {message.relative_uri().path()};
-  const vector<string> undecoded_paths {uri::split_path(undecoded_path)};
+  const RequestPath undecoded_paths {message.request_uri().path()};
   if (undecoded_paths.size () != 5) {
-    return make_pair (status_codes::BadRequest, table_entity{});
+    return pplx::task_from_result(make_pair (status_codes::BadRequest, table_entity{}));
   }
 
-  const string tname {undecoded_paths[1]};
-  const string token {undecoded_paths[2]};
-  const string partition {undecoded_paths[3]};
-  const string row {undecoded_paths[4]};
-
-  try {
-    uri endpoint_uri {endpoint};
-    storage_credentials creds {token};
-    cloud_table_client client {endpoint_uri, creds};
-
-    table_operation op {table_operation::retrieve_entity(partition, row)};
-    cloud_table table_cred {client.get_table_reference(tname)};
-    table_result retrieve_result {table_cred.execute(op)};
-    if (retrieve_result.http_status_code() == status_codes::NotFound) {
-      cout << "Not found" << endl;
-      return make_pair (status_codes::NotFound,
-                         table_entity{});
-    }
-
-    table_entity entity {retrieve_result.entity()};
-    return make_pair (status_codes::OK,
-                       entity);
-  }
-  catch (const storage_exception& e) {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    cout << e.result().extended_error().message() << endl;
-    if (e.result().http_status_code() == status_codes::Forbidden)
-      return make_pair (status_codes::Forbidden,
-                         table_entity{});
-    else
-      return make_pair (status_codes::InternalError,
-                         table_entity{});
-  }
+  const string tname {undecoded_paths.segment(1).str()};
+  const string token {undecoded_paths.segment(2).str()};
+  const string partition {undecoded_paths.segment(3).str()};
+  const string row {undecoded_paths.segment(4).str()};
+
+  uri endpoint_uri {endpoint};
+  storage_credentials creds {token};
+  cloud_table_client client {endpoint_uri, creds};
+
+  table_operation op {table_operation::retrieve_entity(partition, row)};
+  cloud_table table_cred {client.get_table_reference(tname)};
+  return table_cred.execute_async(op)
+    .then([] (pplx::task<table_result> read) -> pair<status_code,table_entity>
+      {
+        try {
+          table_result retrieve_result {read.get()};
+          if (retrieve_result.http_status_code() == status_codes::NotFound) {
+            cout << "Not found" << endl;
+            return make_pair (status_codes::NotFound,
+                               table_entity{});
+          }
+          return make_pair (status_codes::OK,
+                             retrieve_result.entity());
+        }
+        catch (const storage_exception& e) {
+          return make_pair (token_error(e),
+                             table_entity{});
+        }
+      });
 }
 
 /*
@@ -107,74 +123,64 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
     "http://STORAGE.table.core.windows.net/", where STORAGE is
     replaced by the user's Azure Storage account name.
   props is an unordered_map of properties to be merged into
-    the entity. This will typically be the result of get_json_body().
+    the entity. This will typically be the result of get_json_body_async().
+
+  A merge fails with NotFound if the entity does not exist, so no
+  separate read is needed to check for it. If message has an If-Match
+  header, the merge is conditional on that ETag and fails with
+  PreconditionFailed if the entity has changed.
 
-  Returns:  HTTP status code from the write.
+  Returns a task that completes, without blocking the caller, with
+  the HTTP status code from the write.
  */
-status_code update_with_token (const http_request& message,
-                               const string& endpoint,
-                               const unordered_map<string,string>& props) {
+pplx::task<status_code> update_with_token_async (const http_request& message,
+                                                 const string& endpoint,
+                                                 const unordered_map<string,string>& props) {
   
   /*
     Tokens can contain %2F ('/'). Thus we split the URI path
     *before* decoding and pass the undecoded values to Azure Storage
    */
-  const string undecoded_path {message.relative_uri().path()};
-  const vector<string> undecoded_paths {uri::split_path(undecoded_path)};
+  const RequestPath undecoded_paths {message.request_uri().path()};
   if (undecoded_paths.size () != 5) {
-    return status_codes::BadRequest;
+    return pplx::task_from_result(status_codes::BadRequest);
   }
   
-  const string tname {undecoded_paths[1]};
-  const string token {undecoded_paths[2]};
-  const string partition {undecoded_paths[3]};
-  const string row {undecoded_paths[4]};
+  const string tname {undecoded_paths.segment(1).str()};
+  const string token {undecoded_paths.segment(2).str()};
+  const string partition {undecoded_paths.segment(3).str()};
+  const string row {undecoded_paths.segment(4).str()};
   table_entity entity {partition, row};
-  try {
-    uri endpoint_uri {endpoint};
-    storage_credentials creds {token};
-    cloud_table_client client {endpoint_uri, creds};
-		
-    table_entity::properties_type& properties = entity.properties();
-    for (const auto v : props) {
-      properties[v.first] = entity_property {v.second};
-    }
-
-    table_operation op {table_operation::merge_entity(entity)};
-    cloud_table table_cred {client.get_table_reference(tname)};
-		// Code Added by Correy
-		azure::storage::table_query query {};
-		azure::storage::table_query_iterator end;
-		azure::storage::table_query_iterator it = table_cred.execute_query(query);
-		bool key_check1 {false};
-		bool key_check2 {false};
-		while(it != end){ // This while loop iterates through the table until it finds the requested partition
-			if( partition == it->partition_key() ){
-				key_check1 = true;
-			}
-			if( row == it->row_key() ){
-				key_check2 = true;
-			}
-			++it;
-		}
-		if(key_check1 == false || key_check2 == false){
-			return status_codes::NotFound;
-		}
-		// End Code
-    table_result update_result {table_cred.execute(op)};
-    status_code status {static_cast<status_code> (update_result.http_status_code())};
-    if (status == status_codes::NoContent || status == status_codes::OK)
-      return status_codes::OK;
-    else
-      return status;
-  }
-  catch (const storage_exception& e)
-  {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    cout << e.result().extended_error().message() << endl;
-    if (e.result().http_status_code() == status_codes::Forbidden)
-      return status_codes::Forbidden;
-    else
-      return status_codes::InternalError;
+
+  uri endpoint_uri {endpoint};
+  storage_credentials creds {token};
+  cloud_table_client client {endpoint_uri, creds};
+
+  table_entity::properties_type& properties = entity.properties();
+  for (const auto v : props) {
+    properties[v.first] = entity_property {v.second};
   }
+
+  const http_headers& headers {message.headers()};
+  auto if_match (headers.find(header_names::if_match));
+  if (if_match != headers.end())
+    entity.set_etag(if_match->second);
+
+  table_operation op {table_operation::merge_entity(entity)};
+  cloud_table table_cred {client.get_table_reference(tname)};
+  return table_cred.execute_async(op)
+    .then([] (pplx::task<table_result> update) -> status_code
+      {
+        try {
+          table_result update_result {update.get()};
+          status_code status {static_cast<status_code> (update_result.http_status_code())};
+          if (status == status_codes::NoContent || status == status_codes::OK)
+            return status_codes::OK;
+          else
+            return status;
+        }
+        catch (const storage_exception& e) {
+          return token_error(e);
+        }
+      });
 }
@@ -1,6 +1,12 @@
 #include "TableCache.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <unordered_map>
 
@@ -15,28 +21,241 @@ using azure::storage::storage_uri;
 using pplx::extensibility::critical_section_t;
 using pplx::extensibility::scoped_critical_section_t;
 
+using std::make_shared;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::shared_ptr;
 using std::string;
 
+using std::chrono::steady_clock;
+
 using web::http::uri;
 
-using cache_t = std::unordered_map<string,cloud_table>;
+namespace {
+  /*
+    A reader's mark of the epoch in which it loaded a snapshot, or 0
+    while it holds none. Each slot has a cache line to itself, so
+    marking it does not contend with the other threads.
+  */
+  struct alignas(64) reader_slot {
+    std::atomic<std::uint64_t> epoch;
+    std::atomic<bool> taken;
+  };
 
-cloud_table TableCache::lookup_table(const string& table_name) {
-  assert (client.base_uri ().path() != "");
+  // Shared by every TableCache; static storage starts them all at 0
+  constexpr std::size_t reader_slot_count {128};
+  reader_slot reader_slots[reader_slot_count];
+  std::atomic<std::uint64_t> current_epoch {1};
+
+  /*
+    The slot a thread has claimed, released when the thread ends
+  */
+  struct slot_claim {
+    reader_slot* slot {nullptr};
+    bool tried {false};
+
+    ~slot_claim () {
+      if (slot)
+        slot->taken.store(false, memory_order_release);
+    }
+  };
+
+  thread_local slot_claim claim {};
+
+  // This thread's slot, or nullptr if every slot was taken when it first read
+  reader_slot* claimed_slot () {
+    if ( ! claim.tried) {
+      claim.tried = true;
+      for (auto& s : reader_slots) {
+        bool free {false};
+        if (s.taken.compare_exchange_strong(free, true)) {
+          claim.slot = &s;
+          break;
+        }
+      }
+    }
+    return claim.slot;
+  }
+}
+
+/*
+  Keeps the snapshot that was current when it was made from being
+  freed until it is destroyed. Readers must not nest on one thread.
+
+  The slot is marked before the pointer is loaded, both sequentially
+  consistent, so a writer that retires the snapshot afterwards sees
+  the mark when it looks for readers.
+*/
+class TableCache::reader {
+private:
+  TableCache& cache;
+  reader_slot* slot;
+  const cache_t* snapshot;
+public:
+  explicit reader (TableCache& c) :
+    cache (c),
+    slot {claimed_slot()},
+    snapshot {nullptr}
+  {
+    if (slot)
+      slot->epoch.store(current_epoch.load());
+    else
+      cache.resplock.lock();
+    snapshot = cache.table_cache.load();
+  }
+
+  ~reader () {
+    if (slot)
+      slot->epoch.store(0, memory_order_release);
+    else
+      cache.resplock.unlock();
+  }
+
+  reader (const reader&) = delete;
+  reader& operator= (const reader&) = delete;
+
+  // The entry of table_name, valid while this reader lives, or nullptr
+  table_entry* find(const string& table_name) const {
+    auto entry (snapshot->find(table_name));
+    return entry == snapshot->end() ? nullptr : entry->second.get();
+  }
+};
+
+TableCache::~TableCache () {
+  for (const auto& r : retired)
+    delete r.snapshot;
+  delete table_cache.load();
+}
+
+/*
+  Make next the current snapshot and free the retired ones no reader
+  can still be using. Called with resplock held.
+*/
+void TableCache::publish(const cache_t* next) {
+  const cache_t* previous {table_cache.exchange(next)};
+  retired.push_back(retired_snapshot {previous, current_epoch.fetch_add(1) + 1});
+
+  std::uint64_t oldest {UINT64_MAX};
+  for (const auto& s : reader_slots) {
+    const std::uint64_t e {s.epoch.load()};
+    if (e != 0 && e < oldest)
+      oldest = e;
+  }
+  auto keep (std::remove_if(retired.begin(), retired.end(), [oldest] (const retired_snapshot& r)
+    {
+      if (r.epoch > oldest)
+        return false;
+      delete r.snapshot;
+      return true;
+    }));
+  retired.erase(keep, retired.end());
+}
+
+/*
+  Enter table_name, unless another writer has since, and record
+  whether it exists
+*/
+void TableCache::insert_entry(const string& table_name, bool exists) {
   scoped_critical_section_t lock {resplock};
 
-  auto entry (table_cache.find(table_name));
-  if (entry == table_cache.end()) {
-      cloud_table table {client.get_table_reference(table_name)};
-      table_cache[table_name] = table;
-      return table;
+  const cache_t* snapshot {table_cache.load()};
+  auto entry (snapshot->find(table_name));
+  if (entry != snapshot->end()) {
+    record_state(*entry->second, exists);
+    return;
+  }
+
+  shared_ptr<table_entry> added {make_shared<table_entry>(client.get_table_reference(table_name))};
+  record_state(*added, exists);
+  std::unique_ptr<cache_t> next {new cache_t {*snapshot}};
+  (*next)[table_name] = added;
+  publish(next.release());
+}
+
+cloud_table TableCache::lookup_table(const string& table_name) {
+  assert (client.base_uri ().path() != "");
+  {
+    reader r {*this};
+    const table_entry* entry {r.find(table_name)};
+    if (entry)
+      return entry->table;
   }
-  return entry->second;
+  return client.get_table_reference(table_name);
 }
 
 bool TableCache::delete_entry(const string& table_name) {
   scoped_critical_section_t lock {resplock};
 
-  cache_t::size_type count {table_cache.erase(table_name)};
-  return count == 1;
+  const cache_t* snapshot {table_cache.load()};
+  if (snapshot->find(table_name) == snapshot->end())
+    return false;
+
+  std::unique_ptr<cache_t> next {new cache_t {*snapshot}};
+  next->erase(table_name);
+  publish(next.release());
+  return true;
+}
+
+/*
+  If the cached state of entry is known and younger than existence_ttl,
+  set exists from it and return true.
+*/
+bool TableCache::known_state(const table_entry& entry, bool& exists) const {
+  int state {entry.state.load(memory_order_acquire)};
+  steady_clock::rep checked {entry.checked.load(memory_order_relaxed)};
+  if (state == unknown ||
+      steady_clock::now() - steady_clock::time_point {steady_clock::duration {checked}} >= existence_ttl)
+    return false;
+  exists = state == present;
+  return true;
+}
+
+void TableCache::record_state(table_entry& entry, bool exists) {
+  entry.checked.store(steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+  entry.state.store(exists ? present : missing, memory_order_release);
+}
+
+bool TableCache::table_exists(const string& table_name) {
+  bool exists {false};
+  {
+    reader r {*this};
+    const table_entry* entry {r.find(table_name)};
+    if (entry && known_state(*entry, exists))
+      return exists;
+  }
+
+  exists = lookup_table(table_name).exists();
+  set_exists(table_name, exists);
+  return exists;
+}
+
+pplx::task<bool> TableCache::table_exists_async(const string& table_name) {
+  bool exists {false};
+  {
+    reader r {*this};
+    const table_entry* entry {r.find(table_name)};
+    if (entry && known_state(*entry, exists))
+      return pplx::task_from_result(exists);
+  }
+
+  return lookup_table(table_name).exists_async().then([this, table_name] (bool found)
+    {
+      set_exists(table_name, found);
+      return found;
+    });
+}
+
+void TableCache::set_exists(const string& table_name, bool exists) {
+  {
+    reader r {*this};
+    table_entry* entry {r.find(table_name)};
+    if (entry) {
+      record_state(*entry, exists);
+      return;
+    }
+  }
+  if ( ! exists)
+    return; // Names of tables that do not exist are not cached
+  insert_entry(table_name, exists);
 }
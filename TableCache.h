@@ -1,28 +1,92 @@
 #ifndef TableCache_h
 #define TableCache_h
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <pplx/pplxtasks.h>
 
 #include <was/storage_account.h>
 #include <was/table.h>
 
+/*
+  Cache of opened table references.
+
+  The table references are held in an immutable snapshot published
+  through an atomic pointer. A hit loads the pointer and marks the
+  reading thread's own slot with the current epoch, so hits take no
+  lock and write no cache line shared with other threads. Inserts and
+  delete_entry() copy the current snapshot under resplock, modify the
+  copy, publish it and retire the old one with a new epoch. A retired
+  snapshot is freed by a later publish once no reader slot holds an
+  epoch older than its own. A thread that finds every slot taken
+  reads under resplock instead.
+
+  Only tables known to exist are entered, so requests naming tables
+  that do not exist cannot grow the cache; lookup_table() returns an
+  uncached reference for them, and each existence check of such a
+  name asks Azure Storage.
+
+  Each entry also remembers whether the table was last seen to exist.
+  That state is trusted for existence_ttl, after which table_exists()
+  asks Azure Storage again.
+*/
 class TableCache {
 private:
+  enum table_state : int { unknown, present, missing };
+
+  struct table_entry {
+    azure::storage::cloud_table table;
+    std::atomic<int> state;
+    std::atomic<std::chrono::steady_clock::rep> checked; // When state was last set
+
+    table_entry (const azure::storage::cloud_table& t) :
+      table {t},
+      state {unknown},
+      checked {0}
+      {};
+  };
+
+  using cache_t = std::unordered_map<std::string,std::shared_ptr<table_entry>>;
+
+  struct retired_snapshot {
+    const cache_t* snapshot;
+    std::uint64_t epoch; // Readers marked with an older epoch may still use it
+  };
+
+  class reader; // Pins the current snapshot while it lives; see TableCache.cpp
+
   azure::storage::cloud_storage_account account;
   azure::storage::cloud_table_client client;
-  std::unordered_map<std::string,azure::storage::cloud_table> table_cache;
+  std::atomic<const cache_t*> table_cache;
+  std::vector<retired_snapshot> retired; // Guarded by resplock
   pplx::extensibility::critical_section_t resplock;
+  std::chrono::steady_clock::duration existence_ttl;
+
+  void publish(const cache_t* next);
+  void insert_entry(const std::string& table_name, bool exists);
+  bool known_state(const table_entry& entry, bool& exists) const;
+  static void record_state(table_entry& entry, bool exists);
 public:
-  TableCache () : 
+  TableCache (std::chrono::steady_clock::duration ttl = std::chrono::seconds {30}) : 
     account {},
     client {},
-    table_cache {},
-    resplock {}
+    table_cache {new cache_t {}},
+    retired {},
+    resplock {},
+    existence_ttl {ttl}
     {};
 
+  ~TableCache ();
+
+  TableCache (const TableCache&) = delete;
+  TableCache& operator= (const TableCache&) = delete;
+
   void init(const std::string& connection) {
     account  = azure::storage::cloud_storage_account::parse(connection);
     client = account.create_cloud_table_client();
@@ -30,6 +94,24 @@ public:
 
   azure::storage::cloud_table lookup_table(const std::string& table_name);
   bool delete_entry(const std::string& table_name);
+
+  /*
+    Return true if the table exists, calling Azure Storage only if
+    the cached state is unknown or older than existence_ttl.
+  */
+  bool table_exists(const std::string& table_name);
+
+  /*
+    As table_exists(), but without blocking: the task is already
+    complete unless Azure Storage must be asked.
+  */
+  pplx::task<bool> table_exists_async(const std::string& table_name);
+
+  /*
+    Record the result of a create, delete or failed storage call
+    so that table_exists() need not ask Azure Storage.
+  */
+  void set_exists(const std::string& table_name, bool exists);
 };
 
 #endif
@@ -17,6 +17,8 @@
 #include <was/table.h>
 
 #include "TableCache.h"
+#include "RequestExecutor.h"
+#include "Router.h"
 #include "make_unique.h"
 
 #include "azure_keys.h"
@@ -60,12 +62,6 @@ const string read_entity_auth {"ReadEntityAuth"};
 const string read_entity_admin {"ReadEntityAdmin"};
 const string get_update_token_op {"GetUpdateToken"};
 const string update_entity_auth {"UpdateEntityAuth"};
-const string sign_on {"SignOn"};
-const string sign_off {"SignOff"};
-const string add_friend {"AddFriend"};
-const string unfriend {"UnFriend"};
-const string update_status {"UpdateStatus"};
-const string read_friend_list {"ReadFriendList"};
 const string push_status {"PushStatus"};
 
 // To ensure multiple users can be logged on at once, the UserID will be the key, and the vector will hold the following information in this order:
@@ -74,6 +70,12 @@ const string push_status {"PushStatus"};
 // vector<string>[2] = (row) (Full Name)
 unordered_map< string, vector<string> > active_users = {};
 
+/*
+  Queue between the listener and the handlers; each handler waits
+  for the other servers, so it has a worker per concurrent request
+*/
+RequestExecutor executor {32, 1000, 32};
+
 /*
   Return true if an HTTP request has a JSON body
 
@@ -179,19 +181,20 @@ pair<status_code,value> push_user_status(const string& partition, const string&
 }
 
 void handle_get(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** GET " << path << endl;
-  auto paths = uri::split_path(path);
+  const RequestPath path {message.request_uri().path()};
+  cout << endl << "**** GET " << path.text() << endl;
+  const command op {path.operation()};
 	const string DataTable {"DataTable"};
 	
-	// paths[0] == ReadFriendList | paths[1] == <UserID>
-	if(paths[0]==read_friend_list){
-		if( active_users.find(paths[1]) == active_users.end() ){
+	// path[0] == ReadFriendList | path[1] == <UserID>
+	if(op == command::read_friend_list && path.size() >= 2){
+		const string user_id {path[1]};
+		if( active_users.find(user_id) == active_users.end() ){
 			message.reply(status_codes::Forbidden);
 			return;
 		}
 		
-		pair<status_code,value> read_result {get_entity_auth(basic_addr, DataTable, active_users[paths[1]][0], active_users[paths[1]][1], active_users[paths[1]][2])};
+		pair<status_code,value> read_result {get_entity_auth(basic_addr, DataTable, active_users[user_id][0], active_users[user_id][1], active_users[user_id][2])};
 		
 		string current_friends;
 		for (const auto& v : read_result.second.as_object()){
@@ -206,29 +209,30 @@ void handle_get(http_request message) {
 		}
 	}
 	
-	// If the code reaches here, then a Malformed Request was done (eg. paths[0] == "DoSomething")
+	// If the code reaches here, then a Malformed Request was done (eg. path[0] == "DoSomething")
 	message.reply(status_codes::BadRequest);
 	return;
 }
 
 void handle_put(http_request message){
-	string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** PUT " << path << endl;
-  auto paths = uri::split_path(path);
+  const RequestPath path {message.request_uri().path()};
+  cout << endl << "**** PUT " << path.text() << endl;
+  const command op {path.operation()};
 	const string DataTable {"DataTable"};
-	// paths[0] == AddFriend | paths[1] == <UserID> | paths[2] == <Friend's Country> | paths[3] == <<Friend's Last Name>,<Friend's First Name>>
-	if(paths[0]==add_friend){
-		if( active_users.find(paths[1]) == active_users.end() ){
-			message.reply(status_codes::Forbidden);
+	// path[0] == AddFriend | path[1] == <UserID> | path[2] == <Friend's Country> | path[3] == <<Friend's Last Name>,<Friend's First Name>>
+	if(op == command::add_friend){
+		if(path.size() < 4){ // We require a UserID, Friend Country and Full Friend Name
+			message.reply(status_codes::BadRequest);
 			return;
 		}
-
-		if(paths.size() < 3){ // We require a UserID, Friend Country and Full Friend Name
-			message.reply(status_codes::BadRequest);
+		const string user_id {path[1]};
+		if( active_users.find(user_id) == active_users.end() ){
+			message.reply(status_codes::Forbidden);
 			return;
 		}
+		const string friend_entry {path[2] + ";" + path[3]};
 		
-		pair<status_code,value> check_friends {get_entity_auth(basic_addr, DataTable, active_users[paths[1]][0], active_users[paths[1]][1], active_users[paths[1]][2])};
+		pair<status_code,value> check_friends {get_entity_auth(basic_addr, DataTable, active_users[user_id][0], active_users[user_id][1], active_users[user_id][2])};
 		string current_friends;
 		string new_friend;
 		string check_for_no_friends;
@@ -236,23 +240,22 @@ void handle_put(http_request message){
 			if(v.first == "Friends") check_for_no_friends = v.second.as_string();
 		}
 		if( (check_friends.second.size() == 0) || (check_for_no_friends == "") ){ // User has no friends
-			new_friend = paths[2] + ";" + paths[3];
+			new_friend = friend_entry;
 		}
 		else{
 			for (const auto& v : check_friends.second.as_object()){
 				if(v.first == "Friends") current_friends = v.second.as_string();
 			}
-			new_friend = current_friends + "|" + paths[2] + ";" + paths[3];
+			new_friend = current_friends + "|" + friend_entry;
 		}
 		
-		string already_exists {paths[2]+";"+paths[3]};
-		if(current_friends.find(already_exists) != string::npos){ 
+		if(current_friends.find(friend_entry) != string::npos){ 
 			message.reply(status_codes::OK); // The user trying to be added as a friend is already a friend
 			return;
 		}
 		
 		value props { build_json_object(vector<pair<string,string>> { make_pair(string("Friends"),string(new_friend))})};
-		int add_friend_result = put_entity_auth(basic_addr, DataTable, active_users[paths[1]][0], active_users[paths[1]][1], active_users[paths[1]][2], props);
+		int add_friend_result = put_entity_auth(basic_addr, DataTable, active_users[user_id][0], active_users[user_id][1], active_users[user_id][2], props);
 		if(add_friend_result == status_codes::OK){
 			message.reply(status_codes::OK);
 			return;
@@ -262,19 +265,24 @@ void handle_put(http_request message){
 			return;
 		}
 	}
-	// paths[0] == UnFriend | paths[1] == <UserID> | paths[2] == <Country> | paths[3] == <Last Name, First Name>
+	// path[0] == UnFriend | path[1] == <UserID> | path[2] == <Country> | path[3] == <Last Name, First Name>
 	// "USA;Shinoda,Mike|Canada;Edwards,Kathleen|Korea;Bae,Doona"
-	if(paths[0]==unfriend){
-		if( active_users.find(paths[1]) == active_users.end() ){
+	if(op == command::unfriend){
+		if(path.size() < 4){ // We require a UserID, Friend Country and Full Friend Name
+			message.reply(status_codes::BadRequest);
+			return;
+		}
+		const string user_id {path[1]};
+		if( active_users.find(user_id) == active_users.end() ){
 			message.reply(status_codes::Forbidden);
 			return;
 		}
 
-		pair<status_code,value> check_friends {get_entity_auth(basic_addr, DataTable, active_users[paths[1]][0], active_users[paths[1]][1], active_users[paths[1]][2])};
+		pair<status_code,value> check_friends {get_entity_auth(basic_addr, DataTable, active_users[user_id][0], active_users[user_id][1], active_users[user_id][2])};
 		
 		string current_friends;
 		string check_for_no_friends;
-		string passed_in {paths[2] + ";" + paths[3]};
+		const string passed_in {path[2] + ";" + path[3]};
 		for (const auto& v : check_friends.second.as_object()){
 			if(v.first == "Friends") check_for_no_friends = v.second.as_string();
 		}
@@ -302,7 +310,7 @@ void handle_put(http_request message){
 		}
 		
 		value props { build_json_object(vector<pair<string,string>> { make_pair(string("Friends"),string(current_friends))})};
-		int unfriend_result = put_entity_auth(basic_addr, DataTable, active_users[paths[1]][0], active_users[paths[1]][1], active_users[paths[1]][2], props);
+		int unfriend_result = put_entity_auth(basic_addr, DataTable, active_users[user_id][0], active_users[user_id][1], active_users[user_id][2], props);
 		
 		if(unfriend_result == status_codes::OK){
 			message.reply(status_codes::OK);
@@ -314,18 +322,24 @@ void handle_put(http_request message){
 		}
 	}
 	
-	// paths[0] == UpdateStatus | paths[1] == <UserID> | paths[2] == <User Status>
-	if(paths[0]==update_status){
-		if( active_users.find(paths[1]) == active_users.end() ){ // User is not signed in
+	// path[0] == UpdateStatus | path[1] == <UserID> | path[2] == <User Status>
+	if(op == command::update_status){
+		if(path.size() < 3){ // We require a UserID and a status
+			message.reply(status_codes::BadRequest);
+			return;
+		}
+		const string user_id {path[1]};
+		const string status {path[2]};
+		if( active_users.find(user_id) == active_users.end() ){ // User is not signed in
 			message.reply(status_codes::Forbidden);
 			return;
 		}
 		
-		value status_prop { build_json_object(vector<pair<string,string>> { make_pair(string("Status"),string(paths[2])) } ) };
+		value status_prop { build_json_object(vector<pair<string,string>> { make_pair(string("Status"),string(status)) } ) };
 		
-		int status_change_result = put_entity_auth(basic_addr, DataTable, active_users[paths[1]][0], active_users[paths[1]][1], active_users[paths[1]][2], status_prop);
+		int status_change_result = put_entity_auth(basic_addr, DataTable, active_users[user_id][0], active_users[user_id][1], active_users[user_id][2], status_prop);
 		
-		pair<status_code,value> check_friends {get_entity_auth(basic_addr, DataTable, active_users[paths[1]][0], active_users[paths[1]][1], active_users[paths[1]][2])};
+		pair<status_code,value> check_friends {get_entity_auth(basic_addr, DataTable, active_users[user_id][0], active_users[user_id][1], active_users[user_id][2])};
 		
 		string current_friends;
 		string check_for_no_friends;
@@ -343,11 +357,11 @@ void handle_put(http_request message){
 		}
 		// cout << "Current friends is: " << current_friends << endl;
 		
-		// pair<status_code,value> check_status {get_entity_auth(basic_addr, DataTable, active_users[paths[1]][0], active_users[paths[1]][1], active_users[paths[1]][2])};
+		// pair<status_code,value> check_status {get_entity_auth(basic_addr, DataTable, active_users[user_id][0], active_users[user_id][1], active_users[user_id][2])};
 		
-		value props { build_json_object(vector<pair<string,string>> { make_pair(string("Status"),string(paths[2])), make_pair(string("Friends"),string(current_friends) ) } ) };
+		value props { build_json_object(vector<pair<string,string>> { make_pair(string("Status"),string(status)), make_pair(string("Friends"),string(current_friends) ) } ) };
 		
-		pair<status_code,value> push_status_result = do_request( methods::POST, push_addr + push_status + "/" + active_users[paths[1]][1] + "/" + active_users[paths[1]][2] + "/" + paths[2], props );
+		pair<status_code,value> push_status_result = do_request( methods::POST, push_addr + push_status + "/" + active_users[user_id][1] + "/" + active_users[user_id][2] + "/" + status, props );
 		
 		if(push_status_result.first == status_codes::InternalError){
 			message.reply(status_codes::ServiceUnavailable);
@@ -355,8 +369,8 @@ void handle_put(http_request message){
 		}
 		/*
 		try{
-			// push_user_status(active_users[paths[1]][1], active_users[paths[1]][2], paths[2], props);
-			do_request( methods::POST, push_addr + push_status + "/" + active_users[paths[1]][1] + "/" + active_users[paths[1]][2] + "/" + paths[2], props );
+			// push_user_status(active_users[user_id][1], active_users[user_id][2], status, props);
+			do_request( methods::POST, push_addr + push_status + "/" + active_users[user_id][1] + "/" + active_users[user_id][2] + "/" + status, props );
 		}catch(const web::uri_exception& e){
 			message.reply(status_codes::ServiceUnavailable);
 			return;
@@ -365,18 +379,18 @@ void handle_put(http_request message){
 		message.reply(status_codes::OK);
 		return;
 	}
-	// If the code reaches here, then a Malformed Request was done (eg. paths[0] == "DoSomething")
+	// If the code reaches here, then a Malformed Request was done (eg. path[0] == "DoSomething")
 	message.reply(status_codes::BadRequest);
 	return;
 }
 
 void handle_post(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
-  cout << endl << "**** POST " << path << endl;
-  auto paths = uri::split_path(path);
+  const RequestPath path {message.request_uri().path()};
+  cout << endl << "**** POST " << path.text() << endl;
+  const command op {path.operation()};
 			
-	if(paths[0] == sign_on){
-		if(paths.size() < 2){ // UserID not passed in
+	if(op == command::sign_on){
+		if(path.size() < 2){ // UserID not passed in
 			message.reply(status_codes::BadRequest);
 			return;
 		}
@@ -387,7 +401,7 @@ void handle_post(http_request message) {
 			message.reply(status_codes::NotFound);
 			return;
 		}
-		const string userID {paths[1]};
+		const string userID {path[1]};
 		string pwd {};
 		unordered_map<string,string>::const_iterator got = stored_message.find("Password");
 		if( got != stored_message.end() ){
@@ -416,7 +430,7 @@ void handle_post(http_request message) {
 			pair<status_code,value> data_result {get_entity_auth(basic_addr, DataTable, auth_result.second, partition, row)};
 			
 			if(data_result.first == status_codes::OK){
-				active_users.insert( { paths[1], {auth_result.second, partition, row} } ); // Adding the user to the unordered_map of active users
+				active_users.insert( { userID, {auth_result.second, partition, row} } ); // Adding the user to the unordered_map of active users
 				message.reply(status_codes::OK);
 				return;
 			}
@@ -432,13 +446,14 @@ void handle_post(http_request message) {
 		
 	}
 	
-	if(paths[0] == sign_off){
-		if(paths.size() < 2){ // UserID not passed in
+	if(op == command::sign_off){
+		if(path.size() < 2){ // UserID not passed in
 			message.reply(status_codes::BadRequest);
 			return;
 		}
-		if( active_users.find(paths[1]) != active_users.end() ){
-			active_users.erase(paths[1]);
+		const string userID {path[1]};
+		if( active_users.find(userID) != active_users.end() ){
+			active_users.erase(userID);
 			message.reply(status_codes::OK);
 			return;
 		}
@@ -447,7 +462,7 @@ void handle_post(http_request message) {
 			return;
 		}
 	}
-	// If the code reaches here, then a Malformed Request was done (eg. paths[0] == "DoSomething")
+	// If the code reaches here, then a Malformed Request was done (eg. path[0] == "DoSomething")
 	message.reply(status_codes::BadRequest);
 	return;
 }
@@ -460,9 +475,9 @@ int main (int argc, char const * argv[]) {
   // table_cache.init (storage_connection_string);
 
   cout << "Opening listener" << endl;
-  listener.support(methods::GET, &handle_get);
-  listener.support(methods::POST, &handle_post);
-  listener.support(methods::PUT, &handle_put);
+  listener.support(methods::GET, executor.admit(&handle_get));
+  listener.support(methods::POST, executor.admit(&handle_post));
+  listener.support(methods::PUT, executor.admit(&handle_put));
   //listener.support(methods::DEL, &handle_delete);
   listener.open().wait(); // Wait for listener to complete starting
 
@@ -471,6 +486,8 @@ int main (int argc, char const * argv[]) {
   getline(std::cin, line);
 
   // Shut it down
+  executor.stop();
   listener.close().wait();
+  cout << "Requests: " << executor.get_metrics() << endl;
   cout << "Closed" << endl;
 }
\ No newline at end of file
@@ -0,0 +1,545 @@
+/*
+  Micro-benchmarks for the server-side data structures.
+
+  Usage: benchmark [name [max_threads]]
+
+  With no arguments, every benchmark but http and lanes is run.
+  max_threads defaults to the number of hardware threads; the
+  serializer and routing benchmarks run on one thread and ignore it.
+
+  The connection string in azure_keys.h is parsed but only the http
+  and lanes benchmarks contact Azure Storage, through a basicserver
+  that must already be running.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cpprest/base_uri.h>
+#include <cpprest/http_client.h>
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+#include <was/storage_account.h>
+#include <was/table.h>
+
+#include "EntityJson.h"
+#include "Router.h"
+#include "TableCache.h"
+
+#include "azure_keys.h"
+
+using azure::storage::cloud_storage_account;
+using azure::storage::cloud_table;
+using azure::storage::cloud_table_client;
+using azure::storage::edm_type;
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+
+using web::http::http_response;
+using web::http::methods;
+using web::http::status_codes;
+using web::http::client::http_client;
+using web::http::uri;
+using web::json::value;
+
+using pplx::extensibility::critical_section_t;
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::thread;
+using std::unordered_map;
+using std::vector;
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr int lookups_per_thread {1000000};
+
+const vector<string> bench_tables {"DataTable", "AuthTable", "TestTable"};
+
+const string server_addr {"http://localhost:34568/"};
+constexpr int requests_per_level {20000};
+const string bench_table {"BenchTable"};
+
+constexpr int serialize_entities {100};
+constexpr int serialize_rounds {2000};
+
+constexpr int routing_rounds {200000};
+
+/*
+  The table cache as it was before the snapshot version:
+  every lookup, hit or miss, takes the same lock.
+ */
+class LockedTableCache {
+private:
+  cloud_table_client client;
+  unordered_map<string,cloud_table> table_cache;
+  critical_section_t resplock;
+public:
+  LockedTableCache () : client {}, table_cache {}, resplock {} {};
+
+  void init(const string& connection) {
+    client = cloud_storage_account::parse(connection).create_cloud_table_client();
+  }
+
+  cloud_table lookup_table(const string& table_name) {
+    scoped_critical_section_t lock {resplock};
+    auto entry (table_cache.find(table_name));
+    if (entry == table_cache.end()) {
+      cloud_table table {client.get_table_reference(table_name)};
+      table_cache[table_name] = table;
+      return table;
+    }
+    return entry->second;
+  }
+};
+
+/*
+  Run lookups_per_thread lookups on each of nthreads threads
+  and return the aggregate lookups per second.
+ */
+template <typename Cache>
+double lookup_rate (Cache& cache, unsigned nthreads) {
+  std::atomic<bool> go {false};
+  vector<thread> workers {};
+  for (unsigned t = 0; t < nthreads; ++t) {
+    workers.push_back(thread {[&cache, &go, t] () {
+          while ( ! go.load())
+            ;
+          for (int i = 0; i < lookups_per_thread; ++i) {
+            cloud_table table {cache.lookup_table(bench_tables[(i + t) % bench_tables.size()])};
+          }
+        }});
+  }
+
+  auto start (bench_clock::now());
+  go.store(true);
+  for (auto& w : workers)
+    w.join();
+  std::chrono::duration<double> elapsed {bench_clock::now() - start};
+  return nthreads * static_cast<double>(lookups_per_thread) / elapsed.count();
+}
+
+/*
+  Compare hit throughput of the single-lock cache and TableCache
+  as the number of threads grows.
+ */
+void bench_tablecache (unsigned max_threads) {
+  LockedTableCache locked {};
+  TableCache snapshot {};
+  locked.init(storage_connection_string);
+  snapshot.init(storage_connection_string);
+
+  // Populate both caches so every timed lookup is a hit; TableCache only holds tables known to exist
+  for (const auto& name : bench_tables) {
+    locked.lookup_table(name);
+    snapshot.set_exists(name, true);
+  }
+
+  cout << "tablecache: hit lookups/s" << endl;
+  cout << "threads\tlocked\tsnapshot" << endl;
+  for (unsigned n = 1; n <= max_threads; n *= 2) {
+    double locked_rate {lookup_rate(locked, n)};
+    double snapshot_rate {lookup_rate(snapshot, n)};
+    cout << n << "\t" << static_cast<long>(locked_rate)
+         << "\t" << static_cast<long>(snapshot_rate) << endl;
+  }
+}
+
+/*
+  Heap allocations made by this thread while counting_allocations is
+  set, counted by the replacement operator new below. Only the
+  single-threaded serializer and routing benchmarks set it, so the
+  threaded benchmarks pay a thread-local test rather than contending
+  on a shared counter.
+ */
+thread_local bool counting_allocations {false};
+thread_local unsigned long allocations {0};
+
+void* operator new (std::size_t size) {
+  if (counting_allocations)
+    ++allocations;
+  if (void* p = std::malloc(size == 0 ? 1 : size))
+    return p;
+  throw std::bad_alloc {};
+}
+
+void operator delete (void* p) noexcept {
+  std::free(p);
+}
+
+using prop_vals_t = vector<std::pair<string,value>>;
+
+/*
+  Entity serialization as it was before EntityJson: each entity is
+  converted to a json::value object, and the array of them to text.
+ */
+value property_value (const entity_property& property) {
+  if (property.property_type() == edm_type::string)
+    return value::string(property.string_value());
+  else if (property.property_type() == edm_type::int32)
+    return value::number(property.int32_value());
+  else if (property.property_type() == edm_type::int64)
+    return value::number(property.int64_value());
+  else if (property.property_type() == edm_type::double_floating_point)
+    return value::number(property.double_value());
+  else if (property.property_type() == edm_type::boolean)
+    return value::boolean(property.boolean_value());
+  return value::string(property.str());
+}
+
+string serialize_tree (const vector<table_entity>& entities) {
+  vector<value> key_vec;
+  for (const auto& e : entities) {
+    prop_vals_t values { std::make_pair("Partition", value::string(e.partition_key())),
+                         std::make_pair("Row", value::string(e.row_key())) };
+    for (const auto& p : e.properties())
+      values.push_back(std::make_pair(p.first, property_value(p.second)));
+    key_vec.push_back(value::object(values));
+  }
+  return value::array(key_vec).serialize();
+}
+
+void serialize_direct (const vector<table_entity>& entities, string& out) {
+  out.clear();
+  out += '[';
+  for (std::size_t i = 0; i < entities.size(); ++i) {
+    if (i > 0)
+      out += ',';
+    append_entity_json(out, entities[i], true);
+  }
+  out += ']';
+}
+
+/*
+  Compare heap allocations and time per entity of the two serializers,
+  over a page of entities shaped like DataTable rows. The direct
+  serializer reuses its string, as handlers do through json_buffer().
+ */
+void bench_serializer () {
+  vector<table_entity> entities {};
+  for (int row = 0; row < serialize_entities; ++row) {
+    table_entity e {"Bench", "Row" + std::to_string(row)};
+    auto& properties (e.properties());
+    properties["Friends"] = entity_property {string {"USA;Shinjuku|Canada;Vancouver|Korea;Seoul"}};
+    properties["Status"] = entity_property {string {"Writing \"benchmarks\"\tagain"}};
+    properties["Updates"] = entity_property {string {"Went hiking\nSaw a bear\n"}};
+    properties["Visits"] = entity_property {static_cast<std::int32_t>(row)};
+    properties["Score"] = entity_property {row / 7.0};
+    properties["Active"] = entity_property {row % 2 == 0};
+    entities.push_back(e);
+  }
+
+  string direct {};
+  serialize_direct(entities, direct); // Grow the reused string first
+  const bool same {value::parse(direct) == value::parse(serialize_tree(entities))};
+
+  cout << "serializer: " << serialize_entities << " entities per body, output "
+       << (same ? "matches" : "DIFFERS") << endl;
+  cout << "method\tallocs/entity\tns/entity" << endl;
+  auto measure = [&entities] (const string& name, std::function<void()> run) {
+    const unsigned long before {allocations};
+    counting_allocations = true;
+    auto start (bench_clock::now());
+    for (int i = 0; i < serialize_rounds; ++i)
+      run();
+    std::chrono::duration<double, std::nano> elapsed {bench_clock::now() - start};
+    counting_allocations = false;
+    const double count {static_cast<double>(serialize_rounds) * entities.size()};
+    cout << name << "\t" << (allocations - before) / count
+         << "\t" << elapsed.count() / count << endl;
+  };
+  measure("tree", [&entities] () { serialize_tree(entities); });
+  measure("direct", [&entities, &direct] () { serialize_direct(entities, direct); });
+}
+
+/*
+  The command names in the order BasicServer, then the other servers,
+  compared them before Router
+ */
+const vector<string> command_names {
+  "CreateTableAdmin", "DeleteTableAdmin", "UpdateEntityAdmin", "DeleteEntityAdmin",
+  "ReadEntityAdmin", "ReadEntitiesAdmin", "ReadEntityAuth", "UpdateEntityAuth",
+  "AddPropertyAdmin", "UpdatePropertyAdmin", "GetJobAdmin", "CancelJobAdmin",
+  "BulkUpdateEntityAdmin",
+  "GetReadToken", "GetUpdateToken", "GetUpdateData",
+  "SignOn", "SignOff", "AddFriend", "UnFriend", "UpdateStatus", "ReadFriendList",
+  "PushStatus"
+};
+
+/*
+  Routing as it was before Router: the whole path is decoded and
+  split into strings, and the first compared with each command in turn.
+  Returns the index of the command, or command_names.size(), plus the
+  length of the operands a handler would then read.
+ */
+std::size_t route_by_strings (const string& path) {
+  const vector<string> paths {uri::split_path(uri::decode(path))};
+  std::size_t i {0};
+  if ( ! paths.empty())
+    while (i < command_names.size() && paths[0] != command_names[i])
+      ++i;
+  for (std::size_t s = 1; s < paths.size(); ++s)
+    i += paths[s].size();
+  return i;
+}
+
+/*
+  Routing by RequestPath, followed by the decoding the handlers do:
+  each operand after the command is decoded once. Returns the same
+  kind of sum as route_by_strings.
+ */
+std::size_t route_by_request_path (const string& path) {
+  const RequestPath request {path};
+  std::size_t i {static_cast<std::size_t>(request.operation())};
+  for (std::size_t s = 1; s < request.size(); ++s)
+    i += request[s].size();
+  return i;
+}
+
+/*
+  Compare heap allocations and time per request of routing by string
+  comparisons and by RequestPath, over paths shaped like the servers'
+  requests. Both include decoding the operands, so the figures are for
+  the whole step from request path to the strings a handler works on.
+ */
+void bench_routing () {
+  const vector<string> paths {
+    "/ReadEntityAdmin/DataTable/USA/Smith,John",
+    "/UpdateEntityAuth/DataTable/sv=2015-04-05%26sig=abc%2Fdef/USA/Smith%2CJohn",
+    "/PushStatus/USA/Smith,John/Feeling%20great",
+    "/SignOn/Smith",
+    "/NoSuchCommand/DataTable"
+  };
+
+  cout << "routing: " << paths.size() << " paths" << endl;
+  cout << "method\tallocs/request\tns/request" << endl;
+  std::size_t sink {0}; // Keeps the routing from being optimized away
+  auto measure = [&paths, &sink] (const string& name, std::function<std::size_t(const string&)> route) {
+    const unsigned long before {allocations};
+    counting_allocations = true;
+    auto start (bench_clock::now());
+    for (int i = 0; i < routing_rounds; ++i)
+      for (const auto& p : paths)
+        sink += route(p);
+    std::chrono::duration<double, std::nano> elapsed {bench_clock::now() - start};
+    counting_allocations = false;
+    const double count {static_cast<double>(routing_rounds) * paths.size()};
+    cout << name << "\t" << (allocations - before) / count
+         << "\t" << elapsed.count() / count << endl;
+  };
+  measure("strings", route_by_strings);
+  measure("router", route_by_request_path);
+  if (sink == 0)
+    cout << "No path was routed" << endl;
+}
+
+/*
+  Counts shared by the request loops of one http level
+ */
+struct request_counts {
+  std::atomic<int> remaining;
+  std::atomic<int> failed;
+  critical_section_t lock;
+  vector<long long> latencies_us;
+
+  request_counts (int requests) : remaining {requests}, failed {0}, lock {}, latencies_us {} {}
+
+  /*
+    Return the latency in ms below which fraction p of the requests finished
+   */
+  double percentile_ms (double p) {
+    scoped_critical_section_t l {lock};
+    if (latencies_us.empty())
+      return 0;
+    vector<long long> sorted {latencies_us};
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[static_cast<std::size_t>(p * (sorted.size() - 1))] / 1000.0;
+  }
+};
+
+/*
+  Send GETs of path one after another until counts.remaining runs out,
+  each from the completion of the one before, so that no thread
+  waits for a response.
+ */
+pplx::task<void> request_loop (http_client& client, const string& path, request_counts& counts) {
+  if (counts.remaining.fetch_sub(1) <= 0)
+    return pplx::task_from_result();
+  auto start (bench_clock::now());
+  return client.request(methods::GET, path)
+    .then([&counts] (http_response response)
+      {
+        if (response.status_code() != status_codes::OK)
+          ++counts.failed;
+        return response.content_ready(); // Scans are only over once their body has arrived
+      })
+    .then([&client, path, &counts, start] (pplx::task<http_response> response)
+      {
+        try {
+          response.get();
+        }
+        catch (const std::exception&) {
+          ++counts.failed;
+        }
+        long long us {std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - start).count()};
+        {
+          scoped_critical_section_t l {counts.lock};
+          counts.latencies_us.push_back(us);
+        }
+        return request_loop(client, path, counts);
+      });
+}
+
+/*
+  Run in_flight request loops of path until counts.remaining runs out
+ */
+void run_requests (http_client& client, const string& path, request_counts& counts, unsigned in_flight) {
+  vector<pplx::task<void>> loops {};
+  for (unsigned i = 0; i < in_flight; ++i)
+    loops.push_back(request_loop(client, path, counts));
+  pplx::when_all(loops.begin(), loops.end()).wait();
+}
+
+/*
+  Create bench_table holding rows entities in partition Bench.
+  Return false if basicserver cannot be reached.
+ */
+bool create_bench_table (http_client& client, int rows) {
+  try {
+    client.request(methods::POST, "CreateTableAdmin/" + bench_table).wait();
+    for (int row = 0; row < rows; ++row) {
+      value props {value::object(vector<std::pair<string,value>> {std::make_pair("Value", value::string("x"))})};
+      client.request(methods::PUT, "UpdateEntityAdmin/" + bench_table + "/Bench/" + std::to_string(row), props).wait();
+    }
+  }
+  catch (const std::exception& e) {
+    cerr << "Cannot reach basicserver at " << server_addr << ": " << e.what() << endl;
+    return false;
+  }
+  return true;
+}
+
+/*
+  Measure basicserver's throughput with from max_threads to
+  10 * max_threads requests in flight at once.
+
+  Each request reads one page of a partition, which bypasses the
+  server's caches, so every request waits on Azure Storage. Handlers
+  that blocked on storage would hold a listener thread per request
+  and stop scaling once the requests in flight outnumber the threads.
+ */
+void bench_http (unsigned max_threads) {
+  http_client client {server_addr};
+  if ( ! create_bench_table(client, 10))
+    return;
+  const string path {"ReadEntityAdmin/" + bench_table + "/Bench/*?pagesize=1"};
+
+  cout << "http: paged partition reads, " << max_threads << " threads" << endl;
+  cout << "in flight\trequests/s\tmean ms\tp99 ms\tfailed" << endl;
+  for (unsigned factor : vector<unsigned> {1, 2, 5, 10}) {
+    unsigned in_flight {factor * max_threads};
+    request_counts counts {requests_per_level};
+
+    auto start (bench_clock::now());
+    run_requests(client, path, counts, in_flight);
+    std::chrono::duration<double> elapsed {bench_clock::now() - start};
+
+    double total_ms {0};
+    for (long long us : counts.latencies_us)
+      total_ms += us / 1000.0;
+    cout << in_flight << "\t" << static_cast<long>(requests_per_level / elapsed.count())
+         << "\t" << total_ms / requests_per_level
+         << "\t" << counts.percentile_ms(0.99)
+         << "\t" << counts.failed.load() << endl;
+  }
+
+  client.request(methods::DEL, "DeleteTableAdmin/" + bench_table).wait();
+}
+
+/*
+  Measure the latency of point reads from basicserver, first alone
+  and then while 4 * max_threads full table scans run. The scans
+  are held in the server's bulk lane, so the point reads' p99 should
+  barely move.
+ */
+void bench_lanes (unsigned max_threads) {
+  http_client client {server_addr};
+  if ( ! create_bench_table(client, 1000))
+    return;
+  const string point_path {"ReadEntityAdmin/" + bench_table + "/Bench/1"};
+  const string scan_path {"ReadEntityAdmin/" + bench_table};
+
+  cout << "lanes: point reads, " << max_threads << " in flight" << endl;
+  cout << "scans\tp50 ms\tp99 ms\tfailed" << endl;
+  for (unsigned scans : vector<unsigned> {0, 4 * max_threads}) {
+    request_counts scan_counts {scans == 0 ? 0 : std::numeric_limits<int>::max()};
+    vector<pplx::task<void>> scan_loops {};
+    for (unsigned i = 0; i < scans; ++i)
+      scan_loops.push_back(request_loop(client, scan_path, scan_counts));
+
+    request_counts counts {requests_per_level};
+    run_requests(client, point_path, counts, max_threads);
+    cout << scans << "\t" << counts.percentile_ms(0.5)
+         << "\t" << counts.percentile_ms(0.99)
+         << "\t" << counts.failed.load() << endl;
+
+    scan_counts.remaining.store(0);
+    pplx::when_all(scan_loops.begin(), scan_loops.end()).wait();
+  }
+
+  client.request(methods::DEL, "DeleteTableAdmin/" + bench_table).wait();
+}
+
+int main (int argc, const char* argv[]) {
+  unsigned max_threads {std::thread::hardware_concurrency()};
+  if (max_threads == 0)
+    max_threads = 4;
+  if (argc >= 3)
+    max_threads = static_cast<unsigned>(std::atoi(argv[2]));
+
+  bool all {argc < 2};
+  bool ran {false};
+  if (all || std::strcmp(argv[1], "tablecache") == 0) {
+    bench_tablecache(max_threads);
+    ran = true;
+  }
+  if (all || std::strcmp(argv[1], "serializer") == 0) {
+    bench_serializer();
+    ran = true;
+  }
+  if (all || std::strcmp(argv[1], "routing") == 0) {
+    bench_routing();
+    ran = true;
+  }
+  if ( ! all && std::strcmp(argv[1], "http") == 0) {
+    bench_http(max_threads);
+    ran = true;
+  }
+  if ( ! all && std::strcmp(argv[1], "lanes") == 0) {
+    bench_lanes(max_threads);
+    ran = true;
+  }
+
+  if ( ! ran) {
+    cerr << "Usage: benchmark [tablecache|serializer|routing|http|lanes [max_threads]]" << endl;
+    return 1;
+  }
+  return 0;
+}
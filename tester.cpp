@@ -3,9 +3,11 @@
  */
 
 #include <algorithm>
+#include <chrono>
 #include <exception>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -16,6 +18,8 @@
 
 #include <UnitTest++/UnitTest++.h>
 
+#include "Compression.h"
+
 using std::cerr;
 using std::cout;
 using std::endl;
@@ -24,6 +28,7 @@ using std::pair;
 using std::string;
 using std::vector;
 
+using web::http::header_names;
 using web::http::http_headers;
 using web::http::http_request;
 using web::http::http_response;
@@ -65,6 +70,16 @@ const string read_friend_list {"ReadFriendList"};
 const string add_property_admin {"AddPropertyAdmin"};
 const string update_property_admin {"UpdatePropertyAdmin"};
 
+// Background jobs started by the table-wide operations
+const string get_job_admin {"GetJobAdmin"};
+const string cancel_job_admin {"CancelJobAdmin"};
+
+// Upsert of many entities in one request
+const string bulk_update_entity_admin {"BulkUpdateEntityAdmin"};
+
+// Read of many entities by key in one request
+const string read_entities_admin {"ReadEntitiesAdmin"};
+
 static constexpr const char* user_addr {"http://localhost:34572/"};
 
 /*
@@ -326,6 +341,55 @@ int delete_entity (const string& addr, const string& table, const string& partit
                 addr + delete_entity_admin + "/" + table + "/" + partition + "/" + row)};
   return result.first;
 }
+/*
+  Make a request with one extra header, returning the status code
+  and the ETag header of the response (empty if it has none)
+
+  header: name of the header, e.g. header_names::if_match
+  header_value: its value
+  req_body: [optional] a json::value to be passed as the message body
+ */
+pair<status_code,string> etag_request (const method& http_method, const string& uri_string,
+                                       const string& header, const string& header_value,
+                                       const value& req_body = value {}) {
+  http_request request {http_method};
+  request.headers().add(header, header_value);
+  if (req_body != value {}) {
+    request.headers().add("Content-Type", "application/json");
+    request.set_body(req_body);
+  }
+
+  http_client client {uri_string};
+  http_response response {client.request(request).get()};
+  const http_headers& headers {response.headers()};
+  auto etag (headers.find(header_names::etag));
+  return make_pair(response.status_code(), etag == headers.end() ? string {} : etag->second);
+}
+
+/*
+  Make a GET request with the given Accept-Encoding header (none if
+  empty), returning the status code, the Content-Encoding of the
+  response (empty if it has none) and its body as received
+ */
+struct encoded_response {
+  status_code code;
+  string encoding;
+  string body;
+};
+
+encoded_response encoded_get (const string& uri_string, const string& accept_encoding) {
+  http_request request {methods::GET};
+  if ( ! accept_encoding.empty())
+    request.headers().add(header_names::accept_encoding, accept_encoding);
+  http_client client {uri_string};
+  http_response response {client.request(request).get()};
+  const http_headers& headers {response.headers()};
+  auto encoding (headers.find(header_names::content_encoding));
+  vector<unsigned char> body {response.extract_vector().get()};
+  return encoded_response {response.status_code(), encoding == headers.end() ? string {} : encoding->second,
+                           string(body.begin(), body.end())};
+}
+
 /********************* 
 **CODE ADDED - BEGIN**
 **********************/
@@ -352,10 +416,38 @@ int put_multi_properties_entity (const string& addr, const string& table, const
   return result.first;
 }
 
+/*
+  Wait for the background job started by a request that was answered
+  with 202 Accepted and {"JobId": <id>}, and return its final state.
+  Return an empty string if the job is unknown or does not finish
+  within a minute.
+ */
+string wait_for_job (const string& addr, const value& accepted) {
+  if ( ! accepted.is_object() || ! accepted.has_field("JobId"))
+    return string {};
+  string id {accepted.at("JobId").as_string()};
+  for (int i = 0; i < 600; ++i) {
+    pair<status_code,value> result {do_request(methods::GET, addr + get_job_admin + "/" + id)};
+    if (result.first != status_codes::OK)
+      return string {};
+    string state {result.second.at("State").as_string()};
+    if (state != "Queued" && state != "Running")
+      return state;
+    std::this_thread::sleep_for(std::chrono::milliseconds {100});
+  }
+  return string {};
+}
+
+/*
+  Start an UpdatePropertyAdmin job and wait for it to finish.
+  Return InternalError if the job was accepted but did not succeed.
+ */
 int update_property (const string& addr, const string& table, const value& properties){
   pair<status_code,value> result { 
     do_request(methods::PUT, 
       addr + update_property_admin + "/" + table, properties)};
+  if (result.first == status_codes::Accepted && wait_for_job(addr, result.second) != "Succeeded")
+    return status_codes::InternalError;
   return result.first;
 }
 
@@ -635,6 +727,16 @@ SUITE(GET) {
     };
 
     CHECK_EQUAL(status_codes::OK, result.first);
+
+    // Only the selected properties are returned
+    string entity_uri {string(BasicFixture::addr) + read_entity_admin + "/" + BasicFixture::table + "/"
+                       + BasicFixture::partition + "/" + BasicFixture::row};
+    result = do_request (methods::GET, entity_uri + "?select=Song");
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK(result.second.has_field("Song"));
+    result = do_request (methods::GET, entity_uri + "?select=Album");
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(value {}, result.second);
     } 
 
   /*
@@ -678,6 +780,42 @@ SUITE(GET) {
     compare_json_arrays(exp, result.second);
     CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, partition, row));
   }
+
+  /*
+    A test of GET all table entries one page at a time
+   */
+  TEST_FIXTURE(BasicFixture, GetAllPaged) {
+    string partition {"Canada"};
+    string row {"Katherines,The"};
+    int put_result {put_entity (BasicFixture::addr, BasicFixture::table, partition, row, "Home", "Vancouver")};
+    cerr << "put result " << put_result << endl;
+    assert (put_result == status_codes::OK);
+
+    string base {string(BasicFixture::addr) + read_entity_admin + "/" + string(BasicFixture::table)};
+    CHECK_EQUAL(status_codes::BadRequest, do_request (methods::GET, base + "?pagesize=0").first);
+
+    // Follow the continuation tokens until the last page
+    size_t entities {0};
+    string token {};
+    int pages {0};
+    do {
+      string page_uri {base + "?pagesize=1"};
+      if ( ! token.empty())
+        page_uri += "&continuation=" + token;
+      http_response response {http_client {page_uri}.request(methods::GET).get()};
+      CHECK_EQUAL(status_codes::OK, response.status_code());
+      value page {response.extract_json().get()};
+      CHECK(page.is_array());
+      CHECK(page.as_array().size() <= 1);
+      entities += page.as_array().size();
+      auto next (response.headers().find("X-Continuation-Token"));
+      token = next == response.headers().end() ? string {} : next->second;
+      ++pages;
+    } while ( ! token.empty() && pages < 10);
+    CHECK_EQUAL(2, entities);
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, partition, row));
+  }
   /********************* 
   **CODE ADDED - BEGIN**
   **********************/
@@ -752,6 +890,19 @@ SUITE(GET) {
     CHECK_EQUAL(3, test_result.second.as_array().size());
     CHECK_EQUAL(status_codes::OK, test_result.first);
 
+    //A row prefix only returns the rows that start with it
+    test_result = get_partition_entity(string(BasicFixture::addr), string(BasicFixture::table), partition, "*?prefix=F");
+    CHECK_EQUAL(status_codes::OK, test_result.first);
+    CHECK(test_result.second.is_array());
+    CHECK_EQUAL(1, test_result.second.as_array().size());
+
+    test_result = get_partition_entity(string(BasicFixture::addr), string(BasicFixture::table), partition, "*?prefix=Zelda");
+    CHECK_EQUAL(status_codes::NotFound, test_result.first);
+
+    //A row key ending in '*' is read as a single entity, not as a prefix
+    test_result = get_partition_entity(string(BasicFixture::addr), string(BasicFixture::table), partition, "F*");
+    CHECK_EQUAL(status_codes::NotFound, test_result.first);
+
 
     //Clear Table
     row = "The_Witcher_3";
@@ -807,7 +958,17 @@ SUITE(GET) {
     //Update all entities to have the same one as the first
     auto props = value::object(vector<pair<string,value>> {make_pair(property, value::string(prop_val))});
     first_test = do_request (methods::PUT, addr + add_property_admin + "/" + table, props);
-    CHECK_EQUAL(status_codes::OK, first_test.first);
+    CHECK_EQUAL(status_codes::Accepted, first_test.first);
+    CHECK_EQUAL("Succeeded", wait_for_job(BasicFixture::addr, first_test.second));
+
+    //The finished job reports what it did; unknown jobs are not found
+    string job_id {first_test.second.at("JobId").as_string()};
+    pair<status_code,value> job {do_request (methods::GET, string(BasicFixture::addr) + get_job_admin + "/" + job_id)};
+    CHECK_EQUAL(status_codes::OK, job.first);
+    CHECK_EQUAL(add_property_admin, job.second.at("Operation").as_string());
+    CHECK(job.second.at("Processed").as_integer() >= 5);
+    CHECK_EQUAL(status_codes::NotFound, do_request (methods::GET, string(BasicFixture::addr) + get_job_admin + "/NoSuchJob").first);
+    CHECK_EQUAL(status_codes::NotFound, do_request (methods::DEL, string(BasicFixture::addr) + cancel_job_admin + "/NoSuchJob").first);
 
     //Check that all entities now have the added property (It's 5 because Franklin Aretha got infected too, poor guy)
     pair<status_code,value> second_test = {get_Entities_from_property(BasicFixture::addr, BasicFixture::table, property, prop_val)};
@@ -1077,7 +1238,7 @@ SUITE(GET) {
 
 
     //Update the property value
-    CHECK_EQUAL(status_codes::OK, update_property (BasicFixture::addr, BasicFixture::table, 
+    CHECK_EQUAL(status_codes::Accepted, update_property (BasicFixture::addr, BasicFixture::table, 
       value::object(vector<pair<string,value>> {
         make_pair("Fun", value::string("Yes"))
     })));
@@ -1098,7 +1259,7 @@ SUITE(GET) {
     CHECK_EQUAL(3, count);
 
     //Test result after updating multiple values
-    CHECK_EQUAL(status_codes::OK, update_property (BasicFixture::addr, BasicFixture::table, 
+    CHECK_EQUAL(status_codes::Accepted, update_property (BasicFixture::addr, BasicFixture::table, 
       value::object(vector<pair<string,value>> {
         make_pair("Boring", value::string("Yes")),
         make_pair("Cool", value::string("No"))
@@ -1161,6 +1322,231 @@ SUITE(GET) {
   **CODE ADDED - STOP**
   ********************/
   }
+
+  /*
+    A test of writing several entities in one request, including
+    a row written twice and a malformed element
+   */
+  TEST_FIXTURE(BasicFixture, BulkUpdate) {
+    auto element = [] (const string& partition, const string& row, const string& prop_val) {
+      return value::object(vector<pair<string,value>> {
+        make_pair("Partition", value::string(partition)),
+        make_pair("Row", value::string(row)),
+        make_pair("Properties", value::object(vector<pair<string,value>> {
+          make_pair("Song", value::string(prop_val))
+        }))
+      });
+    };
+    value body {value::array(vector<value> {
+      element("Bulk", "One", "First"),
+      element("Bulk", "Two", "Second"),
+      element("Other", "Three", "Third"),
+      element("Bulk", "One", "Again"),
+      value::object(vector<pair<string,value>> {make_pair("Row", value::string("NoPartition"))})
+    })};
+
+    pair<status_code,value> result {
+      do_request (methods::PUT, string(BasicFixture::addr) + bulk_update_entity_admin + "/" + BasicFixture::table, body)};
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK(result.second.is_array());
+    CHECK_EQUAL(5, result.second.as_array().size());
+    if (result.second.is_array() && result.second.as_array().size() == 5) {
+      const web::json::array& statuses (result.second.as_array());
+      for (int i = 0; i < 4; ++i)
+        CHECK_EQUAL(status_codes::OK, statuses.at(i).at("Status").as_integer());
+      CHECK_EQUAL(string("Three"), statuses.at(2).at("Row").as_string());
+      CHECK_EQUAL(status_codes::BadRequest, statuses.at(4).at("Status").as_integer());
+    }
+
+    // The later write of a row wins
+    result = get_partition_entity (BasicFixture::addr, BasicFixture::table, "Bulk", "One");
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(string("Again"), result.second.at("Song").as_string());
+    result = get_partition_entity (BasicFixture::addr, BasicFixture::table, "Other", "Three");
+    CHECK_EQUAL(status_codes::OK, result.first);
+
+    // The body must be an array, and the table must exist
+    CHECK_EQUAL(status_codes::BadRequest,
+                do_request (methods::PUT, string(BasicFixture::addr) + bulk_update_entity_admin + "/" + BasicFixture::table,
+                            element("Bulk", "One", "First")).first);
+    CHECK_EQUAL(status_codes::NotFound,
+                do_request (methods::PUT, string(BasicFixture::addr) + bulk_update_entity_admin + "/Unknown", body).first);
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, "Bulk", "One"));
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, "Bulk", "Two"));
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, "Other", "Three"));
+  }
+
+  /*
+    A test of conditional GETs and PUTs with ETags
+   */
+  TEST_FIXTURE(BasicFixture, ConditionalRequests) {
+    string entity_uri {string(BasicFixture::addr) + read_entity_admin + "/" + BasicFixture::table + "/"
+                       + BasicFixture::partition + "/" + BasicFixture::row};
+    string update_uri {string(BasicFixture::addr) + update_entity_admin + "/" + BasicFixture::table + "/"
+                       + BasicFixture::partition + "/" + BasicFixture::row};
+    value props {value::object(vector<pair<string,value>> {make_pair(string(BasicFixture::property), value::string("Think"))})};
+
+    pair<status_code,string> first {etag_request (methods::GET, entity_uri, header_names::if_none_match, "\"none\"")};
+    CHECK_EQUAL(status_codes::OK, first.first);
+    CHECK(first.second.size() > 0);
+
+    // The client's copy is current
+    CHECK_EQUAL(status_codes::NotModified, etag_request (methods::GET, entity_uri, header_names::if_none_match, first.second).first);
+
+    // Only the first of two writes based on the same copy succeeds
+    pair<status_code,string> written {etag_request (methods::PUT, update_uri, header_names::if_match, first.second, props)};
+    CHECK_EQUAL(status_codes::OK, written.first);
+    CHECK(written.second.size() > 0 && written.second != first.second);
+    CHECK_EQUAL(status_codes::PreconditionFailed,
+                etag_request (methods::PUT, update_uri, header_names::if_match, first.second, props).first);
+
+    // The old copy is stale; the new one is current
+    CHECK_EQUAL(status_codes::OK, etag_request (methods::GET, entity_uri, header_names::if_none_match, first.second).first);
+    CHECK_EQUAL(status_codes::NotModified, etag_request (methods::GET, entity_uri, header_names::if_none_match, written.second).first);
+
+    // A conditional write never creates an entity
+    CHECK_EQUAL(status_codes::NotFound,
+                etag_request (methods::PUT, string(BasicFixture::addr) + update_entity_admin + "/" + BasicFixture::table
+                              + "/Nowhere/Nobody", header_names::if_match, "*", props).first);
+  }
+
+  /*
+    A test of compressed responses, for one entity and for a
+    streamed scan of the table
+   */
+  TEST_FIXTURE(BasicFixture, CompressedResponses) {
+    string updates {};
+    while (updates.size() < 4 * compression_threshold)
+      updates += "Status update from Vancouver\n";
+    CHECK_EQUAL(status_codes::OK, put_entity (BasicFixture::addr, BasicFixture::table, "Canada", "Katherines,The", "Updates", updates));
+
+    string entity_uri {string(BasicFixture::addr) + read_entity_admin + "/" + BasicFixture::table + "/Canada/Katherines,The"};
+    string table_uri {string(BasicFixture::addr) + read_entity_admin + "/" + BasicFixture::table};
+    for (const string& uri : {entity_uri, table_uri}) {
+      encoded_response plain {encoded_get(uri, "")};
+      CHECK_EQUAL(status_codes::OK, plain.code);
+      CHECK_EQUAL(string {}, plain.encoding);
+
+      encoded_response gzip {encoded_get(uri, "gzip, deflate")};
+      CHECK_EQUAL(status_codes::OK, gzip.code);
+      CHECK_EQUAL(string("gzip"), gzip.encoding);
+      CHECK(gzip.body.size() < plain.body.size());
+      CHECK_EQUAL(plain.body, decompress(gzip.body));
+
+      encoded_response deflate {encoded_get(uri, "gzip;q=0, deflate")};
+      CHECK_EQUAL(string("deflate"), deflate.encoding);
+      CHECK_EQUAL(plain.body, decompress(deflate.body));
+    }
+
+    // Short bodies are not compressed
+    encoded_response small {encoded_get(string(BasicFixture::addr) + read_entity_admin + "/" + BasicFixture::table + "/"
+                                        + BasicFixture::partition + "/" + BasicFixture::row, "gzip")};
+    CHECK_EQUAL(status_codes::OK, small.code);
+    CHECK_EQUAL(string {}, small.encoding);
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, "Canada", "Katherines,The"));
+  }
+
+  /*
+    A test of reading several entities by key in one request
+   */
+  TEST_FIXTURE(BasicFixture, GetByKeys) {
+    CHECK_EQUAL(status_codes::OK, put_entity (BasicFixture::addr, BasicFixture::table, "Canada", "Katherines,The", "Home", "Vancouver"));
+
+    auto key = [] (const string& partition, const string& row) {
+      return value::object(vector<pair<string,value>> {
+        make_pair("Partition", value::string(partition)),
+        make_pair("Row", value::string(row))
+      });
+    };
+    string uri {string(BasicFixture::addr) + read_entities_admin + "/" + BasicFixture::table};
+    value keys {value::array(vector<value> {
+      key("Canada", "Katherines,The"),
+      key("Nowhere", "Nobody"),
+      key(BasicFixture::partition, BasicFixture::row)
+    })};
+
+    // Entities that do not exist are left out; the others keep the body's order
+    pair<status_code,value> result {do_request (methods::GET, uri, keys)};
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK(result.second.is_array());
+    CHECK_EQUAL(2, result.second.as_array().size());
+    if (result.second.is_array() && result.second.as_array().size() == 2) {
+      CHECK_EQUAL(string("Katherines,The"), result.second.as_array().at(0).at("Row").as_string());
+      CHECK_EQUAL(string("Vancouver"), result.second.as_array().at(0).at("Home").as_string());
+      CHECK_EQUAL(string(BasicFixture::prop_val), result.second.as_array().at(1).at(BasicFixture::property).as_string());
+    }
+
+    // Only the selected properties are returned
+    result = do_request (methods::GET, uri + "?select=Home", keys);
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(2, result.second.as_array().size());
+    if (result.second.is_array() && result.second.as_array().size() == 2)
+      CHECK( ! result.second.as_array().at(1).has_field(BasicFixture::property));
+
+    CHECK_EQUAL(status_codes::BadRequest, do_request (methods::GET, uri, key("Canada", "Katherines,The")).first);
+    CHECK_EQUAL(status_codes::NotFound,
+                do_request (methods::GET, string(BasicFixture::addr) + read_entities_admin + "/Unknown", keys).first);
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, "Canada", "Katherines,The"));
+  }
+
+  /*
+    A test of property values that JSON must escape. UpdateEntityAdmin
+    stores every property as a string, so numbers and booleans in the
+    body are read back as their JSON text.
+   */
+  TEST_FIXTURE(BasicFixture, EscapedProperties) {
+    const string text {"Says \"hi\"\\\n\tthen\x01 leaves, caf\xc3\xa9"};
+    CHECK_EQUAL(status_codes::OK,
+                put_entity (BasicFixture::addr, BasicFixture::table, "Escaped", "Row",
+                            vector<pair<string,value>> {
+                              make_pair("Text", value::string(text)),
+                              make_pair("Count", value::number(-42)),
+                              make_pair("Ratio", value::number(0.5)), // Exact in binary, so its text is "0.5"
+                              make_pair("Done", value::boolean(true))
+                            }));
+
+    // The second read is served from the entity cache
+    for (int i = 0; i < 2; ++i) {
+      pair<status_code,value> result {get_partition_entity (BasicFixture::addr, BasicFixture::table, "Escaped", "Row")};
+      CHECK_EQUAL(status_codes::OK, result.first);
+      CHECK_EQUAL(text, result.second.at("Text").as_string());
+      CHECK_EQUAL(string("-42"), result.second.at("Count").as_string());
+      CHECK_EQUAL(string("0.5"), result.second.at("Ratio").as_string());
+      CHECK_EQUAL(string("true"), result.second.at("Done").as_string());
+    }
+
+    pair<status_code,value> result {get_partition_entity (BasicFixture::addr, BasicFixture::table, "Escaped", "*")};
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(1, result.second.as_array().size());
+    if (result.second.is_array() && result.second.as_array().size() == 1)
+      CHECK_EQUAL(text, result.second.as_array().at(0).at("Text").as_string());
+
+    CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, "Escaped", "Row"));
+  }
+
+  /*
+    A test of how request paths are routed: segments are decoded
+    after the path is split, and unknown commands are refused
+   */
+  TEST_FIXTURE(BasicFixture, Routing) {
+    const string entity_path {string(BasicFixture::table) + "/" + BasicFixture::partition + "/Franklin%2CAretha"};
+
+    // A command name may be percent-encoded, like any segment
+    pair<status_code,value> result {do_request (methods::GET, string(BasicFixture::addr) + "Read%45ntityAdmin/" + entity_path)};
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(string(BasicFixture::prop_val), result.second.at(BasicFixture::property).as_string());
+
+    CHECK_EQUAL(status_codes::BadRequest,
+                do_request (methods::POST, string(BasicFixture::addr) + "CreateTable/" + BasicFixture::table).first);
+    CHECK_EQUAL(status_codes::BadRequest,
+                do_request (methods::DEL, string(BasicFixture::addr) + "ReadEntityAdmin/" + entity_path).first);
+    // A long path still routes to its command, whose handler rejects the extra operands
+    CHECK_EQUAL(status_codes::BadRequest,
+                do_request (methods::GET, string(BasicFixture::addr) + "ReadEntityAdmin/" + entity_path + "/a/b/c/d/e").first);
+  }
 }
 
 class AuthFixture {